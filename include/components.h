@@ -0,0 +1,30 @@
+#ifndef FP_CARDSLICER_COMPONENTS_H
+#define FP_CARDSLICER_COMPONENTS_H
+
+#include <memory>
+#include <vector>
+#include "image.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    // Shorter ink runs are dropped, printed lines and text strokes are thinner than this
+    const unsigned MINIMUM_RUN = 3;
+    // Runs of a row, or rows, with up to this many white pixels between them are joined
+    const unsigned COMPONENT_GAP = 2;
+
+    struct Component {
+      image::Clip box;
+      unsigned pixels = 0;
+      // Ink over the area of the bounding box
+      inline float density() {
+        return box.length() ? (float) pixels / box.length() : 0;
+      }
+    };
+
+    // Connected components of the black pixels of a binary image, labeled with union-find in
+    // a single pass over the rows. Ink of runs thinner than MINIMUM_RUN in either direction, and of
+    // horizontal runs longer than max_run (form lines), is cleared from the image and not labeled.
+    std::vector<Component> LabelComponents(std::shared_ptr<image::Image>& image, unsigned max_run);
+  }
+}
+#endif //FP_CARDSLICER_COMPONENTS_H
@@ -2,29 +2,77 @@
 #define FP_CARDSLICER_IMAGE_H
 #include <string>
 #include <memory>
+#include <stdexcept>
+#include <functional>
 #include <vector>
-#include <vector>
+#include "thread_pool.h"
 namespace fpcard_slicer {
   namespace image {
     typedef unsigned char Pixel;
+    // Pixels of every grayscale value
+    typedef std::vector<unsigned> Histogram;
 
     const Pixel BLACK_COLOR = 0;
     const Pixel WHITE_GRAYSCALE = 255;
     const Pixel WHITE_BINARY = 1;
+    // Filters are not split in bands smaller than this
+    const unsigned MINIMUM_BAND_ROWS = 16;
 
     enum ColorMode {
       Grayscale,
       Binary
     };
+    // How the binarization threshold is taken from the histogram
+    enum Binarization {
+      Mean,
+      Otsu
+    };
     enum Format {
       JPEG,
       PNG,
+      WSQ,
       Other
     };
     struct Size {
       unsigned width;
       unsigned height;
     };
+    // Values are the PNG filter types, Adaptive lets the encoder choose per row
+    enum PngFilter {
+      FilterNone,
+      FilterSub,
+      FilterUp,
+      FilterAverage,
+      FilterPaeth,
+      FilterAdaptive
+    };
+    enum PngEncoder {
+      LibPng,
+      LodePng
+    };
+    struct SaveOptions {
+      int quality = 100;     // jpeg
+      float bitrate = 0.75;  // wsq, 0.75 is about 15:1 at 500 ppi
+      int png_level = 6;     // zlib level, 1 is the fastest
+      PngFilter png_filter = FilterAdaptive;
+      PngEncoder png_encoder = LibPng;
+    };
+    struct Header {
+      Size size;
+      unsigned ppi; // 0 if the file has no resolution
+    };
+
+    // Filter block given at runtime. The kernels are templates over the window
+    // type so FixedWindow turns the block dimensions into compile time constants.
+    struct Window {
+      Window(unsigned bw, unsigned bh): mid_w(bw / 2), mid_h(bh / 2) {}
+      const int mid_w, mid_h;
+    };
+    template<unsigned BW, unsigned BH>
+    struct FixedWindow {
+      static constexpr int mid_w = BW / 2;
+      static constexpr int mid_h = BH / 2;
+    };
 
     class Clip {
     public:
@@ -80,8 +128,19 @@ namespace fpcard_slicer {
         _top += height;
         _bottom += height;
       }
+      // Degrees the box is turned around its center, the pixels of the clip are taken along the
+      // turned box
+      inline const float angle() {
+        return _angle;
+      }
+      inline void set_angle(float value) {
+        _angle = value;
+      }
+      // Box of the image holding the turned clip, cut at 0
+      Clip Bounds();
     private:
       unsigned _left, _right, _top, _bottom;
+      float _angle = 0;
     };
 
     class Image {
@@ -98,14 +157,43 @@ namespace fpcard_slicer {
       ~Image();
       void Save(const std::string&);
       void Save(const std::string&, int);
-      std::shared_ptr<Image> Scale(float);
+      void Save(const std::string&, const SaveOptions&);
+      // The histogram of the scaled image, if asked for, is counted in the same pass
+      std::shared_ptr<Image> Scale(float, Histogram* = nullptr);
+      // Decode without keeping the full resolution image in memory (streamed for PNG)
+      static std::shared_ptr<Image> ReadScaled(const std::string&, float, Histogram* = nullptr);
+      // Rough thumbnail of about 1 / factor, JPEG is reduced by the decoder (not the same pixels as ReadScaled)
+      static std::shared_ptr<Image> ReadPreview(const std::string&, unsigned);
+      static std::vector<std::shared_ptr<Image>> ReadClips(const std::string&, std::vector<Clip>);
+      static Format extension(const std::string& file);
+      static Header ReadHeader(const std::string&);
+      // Filters run serially without a pool
+      static inline void set_thread_pool(std::shared_ptr<parallel::ThreadPool> pool) {
+        _thread_pool = pool;
+      }
+      // A turned clip is resampled, bilinear for grayscale, white outside the image
       std::shared_ptr<Image> Cut(Clip);
+      // Same size, every pixel taken from its place turned by degrees around the center (nearest
+      // pixel, white outside the image)
+      std::shared_ptr<Image> Rotate(float degrees);
       void ApplyBinarizedFilter(unsigned);
+      // Pixels brighter than threshold turn white, the rest black
+      void ApplyThreshold(unsigned threshold);
+      Histogram histogram();
+      // Mean of the pixels that are not scanner black, plus umbral
+      static unsigned MeanThreshold(const Histogram&, unsigned umbral);
+      // Threshold with the largest variance between the two classes, for uneven backgrounds
+      static unsigned OtsuThreshold(const Histogram&);
       void ApplyAverageFilter(unsigned bw, unsigned bh);
       void ApplyVerticalFilter(unsigned, unsigned);
       void ApplyHorizontalWhiteFilter(unsigned, unsigned);
       void ApplyEdgeFilter(unsigned, Pixel);
       void ApplyHorizontalBlackFilter(unsigned, unsigned);
+      // Fixed block versions, only instantiated for the sizes used by the slicer
+      template<unsigned BW, unsigned BH> void ApplyAverageFilter();
+      template<unsigned BW, unsigned BH> void ApplyVerticalFilter();
+      template<unsigned BW, unsigned BH> void ApplyHorizontalWhiteFilter();
+      template<unsigned BW, unsigned BH> void ApplyHorizontalBlackFilter();
       inline const Pixel white() {
         return _mode==Grayscale?WHITE_GRAYSCALE:WHITE_BINARY;
       }
@@ -131,6 +219,12 @@ namespace fpcard_slicer {
       inline const unsigned height() {
         return _size.height;
       }
+      inline const unsigned ppi() {
+        return _ppi;
+      }
+      inline void set_ppi(unsigned value) {
+        _ppi = value;
+      }
       inline const Pixel pixel(unsigned index) {
         CheckRange(index);
 
@@ -163,19 +257,29 @@ namespace fpcard_slicer {
         return sum;
       }
     private:
-      int _id = 0, _len = 0, _ppi = 0, _img_type = 0;
+      int _id = 0, _len = 0, _img_type = 0;
+      unsigned _ppi = 0;
       std::vector<Pixel> _data;
       ColorMode _mode;
       Size _size = {};
-      Format extension(const std::string& file);
       void ReadPNG(const std::string&);
       void ReadJPEG(const std::string &);
-      void SavePNG(const std::string&);
+      void SavePNG(const std::string&, const SaveOptions&);
       void SaveJPEG(const std::string&, int);
+      void SaveWSQ(const std::string&, float);
+      template<typename W> void AverageFilter(const W&);
+      template<typename W> void VerticalFilter(const W&);
+      template<typename W> void HorizontalFilter(const W&, Pixel);
+      // Runs band(y0, y1) over horizontal bands of the image on the thread pool
+      typedef std::function<void(unsigned, unsigned)> Band;
+      void ForEachBand(const Band&);
+      static std::shared_ptr<parallel::ThreadPool> _thread_pool;
       inline void CheckRange(unsigned index) {
         if(index < 0 && index > length())
           throw std::invalid_argument("Out of range");
       }
+      // Pixels of a turned clip, from the nearest pixel or bilinear
+      std::shared_ptr<Image> Resample(Clip, bool nearest);
       inline unsigned XY2Index(unsigned x, unsigned y) {
         return y * width() + x;
       }
@@ -189,6 +293,26 @@ namespace fpcard_slicer {
         for(auto &pixel : _data) pixel/=WHITE_GRAYSCALE;
       }
     };
+
+    // Box downsampling fed one row at a time, so a thumbnail can be built
+    // while the source is decoded. Blocks cut by the border average the pixels inside.
+    class BoxDownsampler {
+    public:
+      BoxDownsampler(Size size, float factor, ColorMode mode);
+      void AddRow(const Pixel*);
+      std::shared_ptr<Image> image();
+      // Of the rows added so far
+      inline const Histogram& histogram() {
+        return _histogram;
+      }
+    private:
+      Size _size, _scaled_size;
+      unsigned _factor, _row = 0;
+      ColorMode _mode;
+      std::vector<unsigned> _sum;
+      std::vector<Pixel> _data;
+      Histogram _histogram;
+    };
   }// namespace image
 }// namespace fpcard_slicer
 
@@ -0,0 +1,77 @@
+#ifndef FP_CARDSLICER_LAYOUT_H
+#define FP_CARDSLICER_LAYOUT_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "image.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    const std::string LAYOUT_FILE_NAME = "slicer.ini";
+
+    // How the fingerprints are found in the binarized thumbnail
+    enum Engine {
+      // Morphology filters, then column and row projections of each half of the card
+      FilterChain,
+      // Connected components of the ink, placed in rows and columns
+      Components
+    };
+
+    // Step of the chain of the filters engine, with its window in thumbnail pixels
+    struct FilterStep {
+      enum Kind {
+        Average,
+        Vertical,
+        HorizontalWhite,
+        HorizontalBlack,
+        // Square window, height is not used
+        Edge
+      };
+      Kind kind;
+      unsigned width, height;
+    };
+
+    // Box in fractions of the card, the card being the area inside the edges
+    struct Region {
+      float left, right, top, bottom;
+      // Box in pixels of a card of the given size, grown by margin on every side
+      image::Clip Resolve(image::Size card, float margin) const;
+    };
+
+    // Known card type, one box per fingerprint in output order
+    struct Layout {
+      std::string name;
+      int bin_umbral = 1;
+      image::Binarization binarization = image::Mean;
+      Engine engine = FilterChain;
+      float margin = 0.05;
+      // Empty for the default chain of Slicer::ApplyFilters
+      std::vector<FilterStep> filters;
+      std::vector<Region> boxes;
+    };
+
+    // Contents of slicer.ini, the [general] section and every [layout NAME] section
+    struct SlicerSettings {
+      int fp_number = 10;
+      int bin_umbral = 1;
+      image::Binarization binarization = image::Mean;
+      Engine engine = FilterChain;
+      std::vector<FilterStep> filters;
+      // Layout used when none is given in the command line, empty for the general search
+      std::string layout;
+      std::map<std::string, Layout> layouts;
+    };
+
+    // "mean" or "otsu", throws std::invalid_argument
+    image::Binarization ParseBinarization(const std::string&);
+    // "filters" or "components", throws std::invalid_argument
+    Engine ParseEngine(const std::string&);
+    // Comma separated "average|vertical|white|black WIDTHxHEIGHT" or "edge SIZE" steps,
+    // throws std::invalid_argument
+    std::vector<FilterStep> ParseFilters(const std::string&);
+    // Throws std::invalid_argument with the line of the first error
+    SlicerSettings ReadSlicerSettings(const std::string& path);
+  }
+}
+#endif //FP_CARDSLICER_LAYOUT_H
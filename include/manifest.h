@@ -0,0 +1,67 @@
+#ifndef FPCARD_SLICER_MANIFEST_H
+#define FPCARD_SLICER_MANIFEST_H
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include "image.h"
+
+namespace fpcard_slicer {
+  namespace application {
+    const std::string MANIFEST_NAME = "fpcard_slicer.manifest";
+
+    // fpcard_slicer.manifest, or fpcard_slicer.shard-I-of-N.manifest for a shard of the batch
+    std::string ManifestName(unsigned shard, unsigned shard_count);
+
+    struct ManifestEntry {
+      std::string source;
+      unsigned long long size = 0;
+      long long mtime = 0; // nanoseconds
+      std::string hash;
+      // HashText of the analysis settings, the clips of other settings are not reused
+      std::string settings;
+      std::vector<image::Clip> clips;
+      std::vector<std::string> outputs;
+    };
+
+    // Record of the processed cards kept in the destination. Entries are appended
+    // as each card is done, so a crashed run keeps everything finished before it.
+    class Manifest {
+    public:
+      explicit Manifest(const std::string& path);
+      // Entry of the same source with the same size, modification time and settings
+      const ManifestEntry* Find(const ManifestEntry&);
+      // Entry of any source with the same content and settings
+      const ManifestEntry* FindContent(const ManifestEntry&);
+      void Add(const ManifestEntry&);
+      // Rewrites the file with only the last entry of every source
+      void Compact();
+    private:
+      std::string _path;
+      std::ofstream _log;
+      std::map<std::string, ManifestEntry> _entries;
+      std::map<std::string, std::string> _content;
+      bool _outdated = false;
+      // false if there is no manifest yet. A manifest of an older version is read and marked
+      // to be rewritten.
+      bool Load();
+      bool Parse(const std::string&, ManifestEntry&);
+      std::string Format(const ManifestEntry&);
+      inline std::string ContentKey(const ManifestEntry& entry) {
+        return std::to_string(entry.size) + ":" + entry.hash + ":" + entry.settings;
+      }
+    };
+
+    // Absolute path without symbolic links or . and .., the path itself if it can not be resolved.
+    // Entries are keyed by it, the same batch is found from any working directory.
+    std::string CanonicalPath(const std::string&);
+    // Fills size and mtime, false if the file does not exist
+    bool StatFile(const std::string&, ManifestEntry&);
+    // 64 bit FNV-1a of the file content in hexadecimal
+    std::string HashFile(const std::string&);
+    // Same hash of a string
+    std::string HashText(const std::string&);
+  }
+}
+#endif //FPCARD_SLICER_MANIFEST_H
@@ -0,0 +1,71 @@
+#ifndef FP_CARDSLICER_MEMSTATS_H
+#define FP_CARDSLICER_MEMSTATS_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace fpcard_slicer {
+  namespace memstats {
+    enum Stage {
+      Other,
+      Decode,
+      Scale,
+      Triage,
+      Binarize,
+      Edges,
+      Deskew,
+      Filters,
+      Search,
+      Crop,
+      Encode,
+      STAGE_COUNT
+    };
+
+    // Bytes are the usable size of the blocks given by malloc
+    struct Counters {
+      unsigned long long allocations = 0;
+      unsigned long long bytes = 0;
+      // Highest live bytes seen while the stage was running
+      long long peak = 0;
+    };
+
+    // Starts counting every operator new, live bytes are counted from here. Blocks allocated
+    // before are not subtracted when they are freed. Nothing is counted unless built with
+    // HAVE_MEMSTATS, the option -DMEMSTATS=ON.
+    void Enable();
+    bool enabled();
+    const char *name(Stage);
+
+    // Stage of the calling thread
+    Stage current();
+
+    // Allocations of the thread are charged to its innermost scope alive
+    class Scope {
+    public:
+      explicit Scope(Stage);
+      ~Scope();
+      // Charges the next allocations to another stage, the previous one is restored all the same
+      void Switch(Stage);
+    private:
+      int _previous;
+    };
+
+    // Charges the allocations of a pool worker to the stage of the thread that gave it the work
+    class Charge {
+    public:
+      explicit Charge(Stage);
+      ~Charge();
+    private:
+      int _previous;
+    };
+
+    // Counters of every stage since the last call, they are added to the batch
+    std::vector<Counters> TakeCard();
+    // Allocations and bytes of every card, highest peak of any card
+    const std::vector<Counters> &batch();
+    // One line per stage with allocations
+    void Print(std::ostream &, const std::vector<Counters> &, const std::string &indent);
+  }
+}
+#endif //FP_CARDSLICER_MEMSTATS_H
@@ -0,0 +1,58 @@
+#ifndef FP_CARDSLICER_METRICS_H
+#define FP_CARDSLICER_METRICS_H
+
+#include <chrono>
+#include <string>
+#include "memstats.h"
+
+namespace fpcard_slicer {
+  namespace metrics {
+    typedef std::chrono::steady_clock Clock;
+
+    enum Result {
+      Done,
+      Skipped,
+      Rejected,
+      Failed,
+      RESULT_COUNT
+    };
+
+    // Upper bounds of the latency histogram buckets in seconds, +Inf is added
+    const double LATENCY_BUCKETS[] = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+    const unsigned BUCKET_COUNT = sizeof(LATENCY_BUCKETS) / sizeof(LATENCY_BUCKETS[0]);
+    // Seconds between two writes of the metrics file
+    const unsigned UPDATE_INTERVAL = 5;
+
+    // Starts counting and writing the file every UPDATE_INTERVAL seconds. It is written
+    // next to itself and renamed, a scraper never reads half of it.
+    void Start(const std::string &path);
+    // Writes the last values and stops the writer
+    void Stop();
+    bool enabled();
+
+    // Source read, waiting for a worker
+    void CardQueued();
+    void CardStarted();
+    void CardFinished(Result, Clock::time_point started);
+    void CountRead(unsigned long long bytes);
+    void CountWritten(unsigned long long bytes);
+    // Every run of a stage, Other is not timed
+    void ObserveStage(memstats::Stage, Clock::time_point started);
+
+    // A memstats::Scope that also times every stage it goes through when the metrics are on
+    class StageScope {
+    public:
+      explicit StageScope(memstats::Stage);
+      ~StageScope();
+      void Switch(memstats::Stage);
+    private:
+      memstats::Scope _memory;
+      memstats::Stage _stage;
+      Clock::time_point _started;
+    };
+
+    // Prometheus text format of the current values
+    std::string Format();
+  }
+}
+#endif //FP_CARDSLICER_METRICS_H
@@ -1,12 +1,38 @@
 #ifndef FPCARD_SLICER_PARSE_ARGUMENTS_H
 #define FPCARD_SLICER_PARSE_ARGUMENTS_H
+#include <string>
+#include <vector>
+#include "image.h"
 namespace fpcard_slicer {
   namespace application {
+    // Accepted --resolution values in ppi
+    const unsigned MINIMUM_RESOLUTION = 100;
+    const unsigned MAXIMUM_RESOLUTION = 10000;
+    // Accepted jpg quality of -q and of a rendition
+    const int MINIMUM_QUALITY = 0;
+    const int MAXIMUM_QUALITY = 100;
+
+    // Extra output of every fingerprint, saved as fp_N_NAME.FORMAT
+    struct Rendition {
+      std::string name;
+      // Either a scale or a resolution in ppi, both rounded to a box downsample of 1 / N
+      float scale = 1;
+      unsigned ppi = 0;
+      std::string format;
+      image::SaveOptions save_options;
+    };
+
     class SlicerConfig {
     public:
       SlicerConfig() = default;
-      inline void set_source_list(std::vector<std::string> values) {
-        _source_list = values;
+      inline void set_source(const std::string& value) {
+        _source = value;
+      }
+      inline void set_source_list_file(const std::string& value) {
+        _source_list_file = value;
+      }
+      inline void set_recursive(bool value) {
+        _recursive = value;
       }
       inline void set_destination(const std::string& value) {
         _destination = value;
@@ -14,14 +40,67 @@ namespace fpcard_slicer {
       inline void set_output_format(const std::string& value) {
         _output_format = value;
       }
-      inline void set_output_quality(int value) {
-        _output_quality = value;
+      inline void set_save_options(const image::SaveOptions& value) {
+        _save_options = value;
       }
       inline void set_demo_mode(bool value) {
         _demo_mode = value;
       }
-      inline std::vector<std::string> source_list() const {
-        return _source_list;
+      inline void set_resolution(unsigned value) {
+        _resolution = value;
+      }
+      inline void set_threads(unsigned value) {
+        _threads = value;
+      }
+      inline void set_force(bool value) {
+        _force = value;
+      }
+      inline void set_renditions(const std::vector<Rendition>& value) {
+        _renditions = value;
+      }
+      inline void set_binarization(const std::string& value) {
+        _binarization = value;
+      }
+      inline void set_engine(const std::string& value) {
+        _engine = value;
+      }
+      inline void set_cards(unsigned value) {
+        _cards = value;
+      }
+      inline void set_memory_limit(unsigned long long value) {
+        _memory_limit = value;
+      }
+      inline void set_memstats(bool value) {
+        _memstats = value;
+      }
+      inline void set_shard(unsigned index, unsigned count) {
+        _shard = index;
+        _shard_count = count;
+      }
+      inline void set_metrics_file(const std::string& value) {
+        _metrics_file = value;
+      }
+      inline void set_triage(bool value) {
+        _triage = value;
+      }
+      inline void set_deskew(bool value) {
+        _deskew = value;
+      }
+      inline void set_layout_file(const std::string& value) {
+        _layout_file = value;
+      }
+      inline void set_layout(const std::string& value) {
+        _layout = value;
+      }
+      inline const std::string& source() const {
+        return _source;
+      }
+      // File with one source per line, "-" for stdin
+      inline const std::string& source_list_file() const {
+        return _source_list_file;
+      }
+      inline bool recursive() {
+        return _recursive;
       }
       inline const std::string& destination() const {
         return _destination;
@@ -29,17 +108,80 @@ namespace fpcard_slicer {
       inline const std::string& output_format() const {
         return _output_format;
       }
-      inline int output_quality() {
-        return _output_quality;
+      // Quality, bitrate and encoder settings of the output format
+      inline const image::SaveOptions& save_options() const {
+        return _save_options;
       }
       inline bool demo_mode() {
         return _demo_mode;
       }
+      // 0 if the resolution is read from the image
+      inline unsigned resolution() {
+        return _resolution;
+      }
+      inline unsigned threads() {
+        return _threads;
+      }
+      // Process every card even if the manifest already has it
+      inline bool force() {
+        return _force;
+      }
+      inline const std::vector<Rendition>& renditions() const {
+        return _renditions;
+      }
+      // mean or otsu, empty for the one of the layout file
+      inline const std::string& binarization() const {
+        return _binarization;
+      }
+      inline const std::string& engine() const {
+        return _engine;
+      }
+      // Cards processed at the same time
+      inline unsigned cards() {
+        return _cards;
+      }
+      // Bytes for the cards running at the same time, 0 for no limit
+      inline unsigned long long memory_limit() {
+        return _memory_limit;
+      }
+      // Count the allocations of every stage and print them per card and per batch
+      inline bool memstats() {
+        return _memstats;
+      }
+      // Sources of shard 1 to shard_count that are processed, shard_count 1 for every source
+      inline unsigned shard() {
+        return _shard;
+      }
+      inline unsigned shard_count() {
+        return _shard_count;
+      }
+      // Prometheus text file kept up to date during the run, empty for none
+      inline const std::string& metrics_file() const {
+        return _metrics_file;
+      }
+      // Check the thumbnail before slicing and skip the pages that are not cards
+      inline bool triage() {
+        return _triage;
+      }
+      // Straighten turned cards, the crops are taken turned
+      inline bool deskew() {
+        return _deskew;
+      }
+      // Empty if there is no slicer.ini
+      inline const std::string& layout_file() const {
+        return _layout_file;
+      }
+      // Card layout of the layout file, empty for its default
+      inline const std::string& layout() const {
+        return _layout;
+      }
     private:
-      int _output_quality;
-      bool _demo_mode;
-      std::string _destination, _output_format;
-      std::vector<std::string> _source_list;
+      image::SaveOptions _save_options;
+      std::vector<Rendition> _renditions;
+      bool _demo_mode, _deskew, _force, _memstats, _recursive, _triage;
+      unsigned _cards, _resolution, _shard, _shard_count, _threads;
+      unsigned long long _memory_limit;
+      std::string _binarization, _destination, _engine, _layout, _layout_file, _metrics_file, _output_format, _source, _source_list_file;
     };
     bool ParseArguments(int argc, char** argv, SlicerConfig&);
   }
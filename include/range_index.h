@@ -0,0 +1,40 @@
+#ifndef FP_CARDSLICER_RANGE_INDEX_H
+#define FP_CARDSLICER_RANGE_INDEX_H
+
+#include <vector>
+
+namespace fpcard_slicer {
+  namespace slicer {
+    // Sparse tables over a fixed profile: range max/min in O(1) and threshold
+    // searches in O(log n). Ties resolve to the leftmost position.
+    class RangeIndex {
+    public:
+      explicit RangeIndex(const std::vector<int>& values);
+      inline unsigned size() const {
+        return (unsigned) _values.size();
+      }
+      inline int value(unsigned index) const {
+        return _values[index];
+      }
+      // Position of the maximum (minimum) in [begin, end), begin < end
+      unsigned ArgMax(unsigned begin, unsigned end) const;
+      unsigned ArgMin(unsigned begin, unsigned end) const;
+      // First position from begin with value > limit (< limit), size() if there is none
+      unsigned FirstAbove(unsigned begin, int limit) const;
+      unsigned FirstBelow(unsigned begin, int limit) const;
+      // Last position in [begin, end) with value < limit, -1 if there is none
+      int LastBelow(unsigned begin, unsigned end, int limit) const;
+    private:
+      std::vector<int> _values;
+      // _max[j][i] and _min[j][i] are positions in [i, i + 2^j)
+      std::vector<std::vector<unsigned>> _max, _min;
+      unsigned Best(const std::vector<std::vector<unsigned>>&, unsigned, unsigned, bool) const;
+      inline unsigned Pick(unsigned a, unsigned b, bool greater) const {
+        if (_values[a] == _values[b])
+          return a < b ? a : b;
+        return ((_values[a] > _values[b]) == greater) ? a : b;
+      }
+    };
+  }// namespace slicer
+}// namespace fpcard_slicer
+#endif //FP_CARDSLICER_RANGE_INDEX_H
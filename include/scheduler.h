@@ -0,0 +1,62 @@
+#ifndef FPCARD_SLICER_SCHEDULER_H
+#define FPCARD_SLICER_SCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "image.h"
+
+namespace fpcard_slicer {
+  namespace application {
+    // Peak bytes of a card per pixel of the scan, measured with --memstats. A progressive
+    // JPEG keeps the coefficients of the whole image in libjpeg (2 bytes per pixel) on top
+    // of the decoded image, a PNG is streamed and only its crops (about half the card) stay.
+    const float JPEG_FOOTPRINT = 3.0;
+    const float PNG_FOOTPRINT = 0.6;
+    // Copies of the thumbnail alive during the analysis
+    const float THUMBNAIL_FOOTPRINT = 8.0;
+    // Codec state, rows and outputs of any card
+    const unsigned long long CARD_OVERHEAD = 1 << 20;
+
+    // Peak memory of slicing a card of the given header, the thumbnail being 1 / factor
+    unsigned long long EstimateFootprint(image::Format, const image::Header&, unsigned factor);
+
+    // Runs cards on a fixed number of workers while their estimated footprints fit in the
+    // memory limit. A card that does not fit waits and the next ones that fit go first, until
+    // it has been passed by as many cards as there are workers. A card larger than the limit
+    // runs alone.
+    class CardScheduler {
+    public:
+      typedef std::function<void()> Job;
+      // memory_limit 0 for no limit
+      CardScheduler(unsigned workers, unsigned long long memory_limit);
+      ~CardScheduler();
+      // Blocks while the queue is full
+      void Submit(unsigned long long footprint, const Job&);
+      // Waits for every job, rethrows the first error of a job
+      void Wait();
+    private:
+      struct Pending {
+        unsigned long long footprint;
+        Job job;
+        unsigned passed;
+      };
+      std::vector<std::thread> _workers;
+      std::deque<Pending> _pending;
+      std::mutex _lock;
+      std::condition_variable _changed;
+      unsigned long long _memory_limit, _in_use = 0;
+      unsigned _running = 0;
+      bool _stop = false;
+      std::exception_ptr _error;
+      void Loop();
+      // Index of the first pending job that can start, _pending.size() if none
+      size_t Admissible();
+    };
+  }
+}
+#endif //FPCARD_SLICER_SCHEDULER_H
@@ -0,0 +1,22 @@
+#ifndef FP_CARDSLICER_SKEW_H
+#define FP_CARDSLICER_SKEW_H
+
+#include <memory>
+#include "image.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    // Degrees searched on each side, a card fed by hand is seldom turned more
+    const float MAXIMUM_SKEW = 5;
+    const float COARSE_SKEW_STEP = 0.5;
+    const float FINE_SKEW_STEP = 0.1;
+    // Smaller angles move the corners of a fingerprint by a few pixels, the crops are not turned
+    const float MINIMUM_SKEW = 0.5;
+
+    // Angle in degrees that straightens the rows of a binary image, the one with the largest variance
+    // of the row profile of the top edges of the ink. Lines and text baselines give the edges, the
+    // fingerprint blobs only a few. Image::Rotate with it turns the image straight.
+    float EstimateSkew(std::shared_ptr<image::Image>& image);
+  }
+}
+#endif //FP_CARDSLICER_SKEW_H
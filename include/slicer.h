@@ -1,8 +1,13 @@
 #ifndef FP_CARDSLICER_SLICER_H
 #define FP_CARDSLICER_SLICER_H
 
+#include <algorithm>
 #include <vector>
+#include "components.h"
 #include "image.h"
+#include "layout.h"
+#include "range_index.h"
+#include "skew.h"
 
 namespace fpcard_slicer {
   namespace slicer {
@@ -14,7 +19,17 @@ namespace fpcard_slicer {
     const int MAXIMUM_SIZE_WIDTH = 100;
     const int MAXIMUM_SIZE_LEFT = 50;
     const int MAXIMUM_SIZE_RIGHT = 70;
+    // Ink over the bounding box of a fingerprint found by the components engine
+    const float MINIMUM_DENSITY = 0.3;
+    // Sizes above are in thumbnail pixels of a REFERENCE_PPI scan reduced by Z_FAC
     const float Z_FAC = 8.0;
+    const unsigned REFERENCE_PPI = 500;
+    // Lower resolutions are taken as missing metadata (scanners default to 72, 96 or 300)
+    const unsigned MINIMUM_PPI = 400;
+
+    // Resolution of a scan with file_ppi in its header (0 if missing), REFERENCE_PPI below MINIMUM_PPI.
+    // A resolution given by the user is taken as it is.
+    unsigned EffectivePpi(unsigned file_ppi);
 
     enum Mode {
       General,
@@ -30,19 +45,73 @@ namespace fpcard_slicer {
         _fp_number(fp_number), _bin_umbral(bin_umbral), _mode(mode), _size_block(size_block) {
 
       }
+      // Sector mode, each fingerprint is searched only inside its box of the layout
+      Slicer(const Layout& layout):
+        _fp_number(layout.boxes.size()), _bin_umbral(layout.bin_umbral), _mode(Sector), _size_block(20),
+        _binarization(layout.binarization), _engine(layout.engine), _filters(layout.filters), _layout(layout) {
+      }
       ~Slicer(){}
       const std::vector<fpcard_slicer::image::Clip> CalculateSlice(std::shared_ptr<image::Image>& img) {
         return CalculateSlice(img, "");
       }
-      const std::vector<fpcard_slicer::image::Clip> CalculateSlice(std::shared_ptr<image::Image>&, const std::string&);
+      // The resolution is the EffectivePpi of the image
+      const std::vector<fpcard_slicer::image::Clip> CalculateSlice(std::shared_ptr<image::Image>& img,
+                                                                   const std::string& partial_out) {
+        return CalculateSlice(img, EffectivePpi(img->ppi()), partial_out);
+      }
+      // With the resolution of the scan already worked out, as a --resolution given by the user
+      const std::vector<fpcard_slicer::image::Clip> CalculateSlice(std::shared_ptr<image::Image>&, unsigned ppi,
+                                                                   const std::string&);
+      // Same as CalculateSlice for an image already scaled by 1 / factor
+      const std::vector<fpcard_slicer::image::Clip> CalculateScaledSlice(std::shared_ptr<image::Image>&, unsigned,
+                                                                         const std::string&);
+      // With the histogram of the scaled image counted while scaling it
+      const std::vector<fpcard_slicer::image::Clip> CalculateScaledSlice(std::shared_ptr<image::Image>&, unsigned,
+                                                                         const image::Histogram&,
+                                                                         const std::string&);
+      inline void set_binarization(image::Binarization value) {
+        _binarization = value;
+      }
+      inline void set_engine(Engine value) {
+        _engine = value;
+      }
+      // Chain of the filters engine, empty for the default one
+      inline void set_filters(const std::vector<FilterStep>& value) {
+        _filters = value;
+      }
+      // Straighten turned cards on the thumbnail, the clips are then turned by the same angle
+      inline void set_deskew(bool value) {
+        _deskew = value;
+      }
+      // Every setting that changes the clips found, for the manifest to tell when a card is sliced again
+      std::string Signature() const;
+      // Downscale factor for the analysis of a scan of ppi, see EffectivePpi. The thumbnail has the
+      // same resolution for any scan.
+      unsigned ScaleFactor(unsigned ppi);
     private:
       int _bin_umbral, _size_block, _fp_number;
       Mode _mode;
+      image::Binarization _binarization = image::Mean;
+      Engine _engine = FilterChain;
+      std::vector<FilterStep> _filters;
+      bool _deskew = true;
+      Layout _layout;
       void ApplyFilters(std::shared_ptr<image::Image> &);
       image::Clip SearchEdges(std::shared_ptr<image::Image> &, int, int);
-      image::Clip SearchFingerprint(std::shared_ptr<image::Image>& image, int index,
-                                    std::vector<int> vec_sum_black,std::vector<int> vec_sum_black_max);
-      std::vector<image::Clip> SearchFingerprints(std::shared_ptr<image::Image>& image);
+      // Next fingerprint from column last, the peak is searched from column start
+      image::Clip SearchFingerprint(std::shared_ptr<image::Image>& image, int last, unsigned start,
+                                    const RangeIndex& columns, const std::vector<unsigned>& row_black);
+      std::vector<image::Clip> SearchFingerprints(std::shared_ptr<image::Image>& image, unsigned count);
+      // Clips of the layout boxes in card coordinates, the analyzed regions are kept for the demo output
+      std::vector<image::Clip> SearchLayout(std::shared_ptr<image::Image>& card,
+                                            std::vector<std::shared_ptr<image::Image>>& regions);
+      // Components engine, the ink is labeled once for the whole card. The image is left with
+      // the ink that was labeled.
+      std::vector<image::Clip> SearchComponents(std::shared_ptr<image::Image>& ink);
+      // Fingerprints of the rows of the card, the largest blobs of the two rows with most ink
+      std::vector<image::Clip> PlaceRows(std::shared_ptr<image::Image>& ink, std::vector<Component>& blobs);
+      // Largest blob centered in each box of the layout, or the box itself
+      std::vector<image::Clip> PlaceLayout(std::shared_ptr<image::Image>& ink, std::vector<Component>& blobs);
     };
   }// namespace image
 }// namespace fpcard_slicer
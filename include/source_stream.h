@@ -0,0 +1,47 @@
+#ifndef FPCARD_SLICER_SOURCE_STREAM_H
+#define FPCARD_SLICER_SOURCE_STREAM_H
+
+#include <dirent.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fpcard_slicer {
+  namespace application {
+    struct Source {
+      std::string path;
+      // Path relative to the source directory, or as written in the list, without extension. The
+      // extension is kept when another image of the same name sits beside it (a.jpg and a.png).
+      // Names the output directory.
+      std::string name;
+    };
+
+    // Yields the sources one at a time as they are found, so processing starts
+    // before a large directory or list has been read to the end
+    class SourceStream {
+    public:
+      // source is a file or a directory, list a file with one path per line or "-" for stdin
+      SourceStream(const std::string& source, bool recursive, const std::string& list);
+      bool Next(Source&);
+    private:
+      struct Directory {
+        std::shared_ptr<DIR> handle;
+        std::string path, relative;
+      };
+      std::string _file;
+      bool _recursive;
+      std::vector<Directory> _directories;
+      std::ifstream _list_file;
+      std::istream* _list = nullptr;
+      void Open(const std::string& path, const std::string& relative);
+    };
+
+    // jpg, jpeg or png in any case
+    bool IsImageFile(const std::string&);
+    // Shard 1 to count of a source, by a stable hash of its name. The name is the relative path, so
+    // every node picks the same sources whatever the mount point, and an output directory has one owner.
+    unsigned ShardOf(const Source&, unsigned count);
+  }
+}
+#endif //FPCARD_SLICER_SOURCE_STREAM_H
@@ -0,0 +1,49 @@
+#ifndef FP_CARDSLICER_THREAD_POOL_H
+#define FP_CARDSLICER_THREAD_POOL_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fpcard_slicer {
+  namespace parallel {
+    typedef std::function<void(unsigned)> Task;
+
+    class ThreadPool {
+    public:
+      // The calling thread counts as one of the threads
+      explicit ThreadPool(unsigned threads);
+      ~ThreadPool();
+      inline unsigned size() const {
+        return (unsigned) _workers.size() + 1;
+      }
+      // Runs task(index) for every index in [0, count) and waits for all of them.
+      // Each thread starts on its own share of the indices and steals half of the
+      // remaining share of another thread when it runs out.
+      void Run(unsigned count, const Task &task);
+    private:
+      struct Range {
+        std::mutex lock;
+        unsigned begin = 0, end = 0;
+      };
+      std::vector<std::thread> _workers;
+      std::unique_ptr<Range[]> _ranges;
+      std::mutex _lock, _run_lock;
+      std::condition_variable _start, _done;
+      const Task *_task = nullptr;
+      unsigned long _generation = 0;
+      unsigned _running = 0;
+      bool _stop = false;
+      std::exception_ptr _error;
+      void Loop(unsigned);
+      void Work(unsigned);
+      bool Next(unsigned, unsigned &);
+    };
+  }// namespace parallel
+}// namespace fpcard_slicer
+
+#endif //FP_CARDSLICER_THREAD_POOL_H
@@ -0,0 +1,38 @@
+#ifndef FP_CARDSLICER_TRIAGE_H
+#define FP_CARDSLICER_TRIAGE_H
+
+#include <string>
+#include "image.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    // Paper brightness minus ink darkness of a page with something printed on it
+    const int MINIMUM_CONTRAST = 40;
+    const float MINIMUM_COVERAGE = 0.02;
+    const float MAXIMUM_COVERAGE = 0.6;
+    // Tallest run of inked rows over the page height, a finger row takes a quarter of a card
+    const float MINIMUM_BAND = 0.12;
+    // Height over width of a page still taken as a card, square cards (8x8 in) are often scanned a bit taller
+    const float MAXIMUM_ASPECT = 1.1;
+    // Ink of the emptiest half over the ink of the page
+    const float MINIMUM_HALF_INK = 0.15;
+
+    enum Verdict {
+      Accepted,
+      // Sliced anyway, reported in the summary
+      Flagged,
+      Rejected
+    };
+
+    struct TriageResult {
+      Verdict verdict = Accepted;
+      std::string reason;
+    };
+
+    // Checks on the thumbnail that the page looks like a card before the expensive stages
+    TriageResult Triage(std::shared_ptr<image::Image>& thumbnail);
+    // With the histogram of the thumbnail counted while scaling it
+    TriageResult Triage(std::shared_ptr<image::Image>& thumbnail, const image::Histogram&);
+  }
+}
+#endif //FP_CARDSLICER_TRIAGE_H
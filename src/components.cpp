@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <deque>
+#include "components.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    namespace {
+      // Black pixels [left, right) of a row
+      struct Run {
+        unsigned left, right, label;
+      };
+
+      unsigned Find(std::vector<unsigned> &parent, unsigned label) {
+        while (parent[label] != label) {
+          parent[label] = parent[parent[label]];
+          label = parent[label];
+        }
+        return label;
+      }
+
+      void Union(std::vector<unsigned> &parent, unsigned a, unsigned b) {
+        a = Find(parent, a);
+        b = Find(parent, b);
+        if (a < b)
+          parent[b] = a;
+        else if (b < a)
+          parent[a] = b;
+      }
+    }
+
+    std::vector<Component> LabelComponents(std::shared_ptr<image::Image> &image, unsigned max_run) {
+      const unsigned width = image->width();
+      // One label per run, the stats of a component end up in its root
+      std::vector<unsigned> parent;
+      std::vector<Component> labels;
+      // Runs of the rows above that are still close enough to join
+      std::deque<std::vector<Run>> above;
+
+      // Thin vertical runs are cleared before labeling, horizontal ones while labeling
+      auto ink = image->get();
+      std::vector<unsigned> column(width, 0);
+      for (unsigned y = 0; y <= image->height(); ++y) {
+        for (unsigned x = 0; x < width; ++x) {
+          if (y < image->height() && ink[y * width + x] == image->black()) {
+            ++column[x];
+            continue;
+          }
+          if (column[x] < MINIMUM_RUN)
+            for (unsigned k = 1; k <= column[x]; ++k)
+              ink[(y - k) * width + x] = image->white();
+          column[x] = 0;
+        }
+      }
+
+      auto line = ink;
+      for (unsigned y = 0; y < image->height(); ++y, line += width) {
+        std::vector<Run> runs;
+
+        for (unsigned x = 0; x < width;) {
+          if (line[x] != image->black()) {
+            ++x;
+            continue;
+          }
+
+          unsigned start = x;
+          while (x < width && line[x] == image->black())
+            ++x;
+          if (x - start < MINIMUM_RUN || x - start > max_run) {
+            std::fill(line + start, line + x, image->white());
+            continue;
+          }
+
+          unsigned label = parent.size();
+          parent.push_back(label);
+          labels.push_back(Component());
+          labels.back().box = image::Clip(start, x, y, y + 1);
+          labels.back().pixels = x - start;
+
+          if (!runs.empty() && start - runs.back().right <= COMPONENT_GAP)
+            Union(parent, runs.back().label, label);
+          runs.push_back(Run{start, x, label});
+        }
+
+        // Both lists are sorted, so the runs above that may touch a run start at or after the first
+        // one that touched the previous run
+        for (auto &row : above) {
+          auto first = row.begin();
+          for (auto &run : runs) {
+            while (first != row.end() && first->right + COMPONENT_GAP < run.left)
+              ++first;
+            for (auto other = first; other != row.end() && other->left <= run.right + COMPONENT_GAP; ++other)
+              Union(parent, other->label, run.label);
+          }
+        }
+
+        above.push_back(std::move(runs));
+        if (above.size() > COMPONENT_GAP + 1)
+          above.pop_front();
+      }
+
+      std::vector<Component> result;
+      std::vector<int> index(labels.size(), -1);
+
+      // Roots are always the lowest label of their set, so they come first
+      for (unsigned label = 0; label < labels.size(); ++label) {
+        unsigned root = Find(parent, label);
+        if (root == label) {
+          index[label] = result.size();
+          result.push_back(labels[label]);
+          continue;
+        }
+
+        auto &component = result[index[root]];
+        auto &box = labels[label].box;
+        component.box.set_left(std::min(component.box.left(), box.left()));
+        component.box.set_right(std::max(component.box.right(), box.right()));
+        component.box.set_bottom(std::max(component.box.bottom(), box.bottom()));
+        component.pixels += labels[label].pixels;
+      }
+
+      return result;
+    }
+  }
+}
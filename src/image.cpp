@@ -5,10 +5,19 @@
 #include <numeric>
 #include <iostream>
 #include <algorithm>
+#include <fstream>
 
 
 #include "image.h"
+#include "memstats.h"
 #include "../third_party/jpeg/jpeg.h"
+#include "../third_party/png/png.h"
+
+#ifdef HAVE_NBIS
+// wsq.h of NBIS has no C++ guards and includes the other NBIS headers, only the encoder is declared
+extern "C" int wsq_encode_mem(unsigned char **, int *, const float, unsigned char *, const int, const int,
+                              const int, const int, char *);
+#endif
 
 #define sround(x) ((int) (((x)<0) ? (x)-0.5 : (x)+0.5))
 
@@ -33,15 +42,23 @@ namespace fpcard_slicer {
       Save(filename, 100);
     }
     void Image::Save(const std::string &filename, int qlt) {
+      SaveOptions options;
+      options.quality = qlt;
+      Save(filename, options);
+    }
+    void Image::Save(const std::string &filename, const SaveOptions &options) {
       if (_mode == Binary)
         ToBinary();
 
       switch (extension(filename)) {
         case Format::JPEG:
-          SaveJPEG(filename, qlt);
+          SaveJPEG(filename, options.quality);
           break;
         case Format::PNG:
-          SavePNG(filename);
+          SavePNG(filename, options);
+          break;
+        case Format::WSQ:
+          SaveWSQ(filename, options.bitrate);
           break;
         default:
           throw std::invalid_argument("Invalid extension");
@@ -53,32 +70,33 @@ namespace fpcard_slicer {
     }
 
     void Image::ReadPNG(const std::string &filename) {
-      std::vector<unsigned char> png;
-      unsigned w, h;
-
-      unsigned error = lodepng::load_file(png, filename);
-
-      if (!error) {
-        Clear();
-        error = lodepng::decode(_data, w, h, png, LodePNGColorType::LCT_GREY, 8);
-      }
-
-      if (error)
-        throw std::invalid_argument("Decode error: " + std::string(lodepng_error_text(error)));
-
-      _size.width = w;
-      _size.height = h;
+      png::load_file(filename, _data, _size.width, _size.height, _ppi);
       _mode = Grayscale;
     }
 
     void Image::ReadJPEG(const std::string &filename) {
-      jpeg::load_file(filename, _data, _size.width, _size.height);
+      jpeg::load_file(filename, _data, _size.width, _size.height, _ppi);
       _mode = Grayscale;
     }
 
-    void Image::SavePNG(const std::string &filename) {
+    void Image::SavePNG(const std::string &filename, const SaveOptions &options) {
+      // libpng refuses an empty image, lodepng writes it as it always did
+      if (options.png_encoder == LibPng && length() > 0) {
+        png::save_file(filename, _data, width(), height(), options.png_level, options.png_filter, _ppi);
+        return;
+      }
+
       std::vector<unsigned char> png;
-      unsigned error = lodepng::encode(png, _data, width(), height(), LodePNGColorType::LCT_GREY, 8);
+      lodepng::State state;
+      state.info_raw.colortype = state.info_png.color.colortype = LodePNGColorType::LCT_GREY;
+      state.info_raw.bitdepth = state.info_png.color.bitdepth = 8;
+      // Same pHYs as the libpng encoder
+      if (_ppi) {
+        state.info_png.phys_defined = 1;
+        state.info_png.phys_x = state.info_png.phys_y = (unsigned) (_ppi / 0.0254 + 0.5);
+        state.info_png.phys_unit = 1;
+      }
+      unsigned error = lodepng::encode(png, _data, width(), height(), state);
 
       if (!error)
         lodepng::save_file(png, filename);
@@ -91,63 +109,350 @@ namespace fpcard_slicer {
       jpeg::save_file(filename, _data, _size.width, _size.height, qlt);
     }
 
+    void Image::SaveWSQ(const std::string &filename, float bitrate) {
+#ifdef HAVE_NBIS
+      unsigned char *wsq = nullptr;
+      int wsq_length = 0;
+      int error = wsq_encode_mem(&wsq, &wsq_length, bitrate, _data.data(), width(), height(), 8,
+                                 _ppi ? (int) _ppi : -1, nullptr);
+
+      if (error)
+        throw std::invalid_argument("Encode error: wsq " + std::to_string(error));
+
+      std::unique_ptr<unsigned char, void (*)(void *)> guard(wsq, free);
+      std::ofstream out(filename, std::ios::binary);
+      out.write((const char *) wsq, wsq_length);
+
+      if (!out)
+        throw std::runtime_error("Could not write " + filename);
+#else
+      throw std::invalid_argument("WSQ output needs NBIS, not found at build time");
+#endif
+    }
+
+    Header Image::ReadHeader(const std::string &filename) {
+      Header header = {};
+
+      switch (extension(filename)) {
+        case Format::JPEG:
+          jpeg::read_info(filename, header.size.width, header.size.height, header.ppi);
+          break;
+        case Format::PNG:
+          png::read_info(filename, header.size.width, header.size.height, header.ppi);
+          break;
+        default:
+          throw std::invalid_argument("Invalid extension");
+      }
+
+      return header;
+    }
+
     Format Image::extension(const std::string &file) {
       // to lower
       std::string filelower(file);
       for (auto &c : filelower) c = std::tolower(c);
 
-      if (filelower.rfind(".jpg") != std::string::npos)
+      auto ends_with = [&](const std::string &suffix) {
+        return filelower.size() >= suffix.size() &&
+               filelower.compare(filelower.size() - suffix.size(), suffix.size(), suffix) == 0;
+      };
+
+      if (ends_with(".jpg") || ends_with(".jpeg"))
         return Format::JPEG;
 
-      if (filelower.rfind(".png") != std::string::npos)
+      if (ends_with(".png"))
         return Format::PNG;
 
+      if (ends_with(".wsq"))
+        return Format::WSQ;
+
       return Format::Other;
     }
 
-    std::shared_ptr<Image> Image::Scale(float factor) {
-      auto h = (unsigned) sround((float) height() * factor);
-      auto w = (unsigned) sround((float) width() * factor);
-      std::vector<Pixel> new_data(h * w);
+    std::shared_ptr<Image> Image::Scale(float factor, Histogram *histogram) {
+      BoxDownsampler downsampler(size(), factor, _mode);
 
-      auto inc_factor = (int) round(1.0 / factor);
+      for (unsigned line = 0; line < height(); ++line)
+        downsampler.AddRow(_data.data() + width() * line);
 
-      unsigned index = 0;
-      for (auto &value : new_data) {
-        unsigned y_start = (index / w) * inc_factor;
-        unsigned x_start = (index % w) * inc_factor;
+      if (histogram)
+        *histogram = downsampler.histogram();
+      return downsampler.image();
+    }
+
+    std::shared_ptr<Image> Image::ReadScaled(const std::string &filename, float factor, Histogram *histogram) {
+      if (extension(filename) != Format::PNG)
+        return Image(filename).Scale(factor, histogram);
+
+      std::unique_ptr<BoxDownsampler> downsampler;
+      png::read_rows(filename,
+                     [&](unsigned w, unsigned h, unsigned) {
+                       downsampler.reset(new BoxDownsampler(Size{w, h}, factor, Grayscale));
+                     },
+                     [&](const Pixel *row, unsigned) {
+                       downsampler->AddRow(row);
+                     });
+
+      if (histogram)
+        *histogram = downsampler->histogram();
+      return downsampler->image();
+    }
+
+    std::shared_ptr<Image> Image::ReadPreview(const std::string &filename, unsigned factor) {
+      if (extension(filename) != Format::JPEG)
+        return ReadScaled(filename, 1.0 / factor);
 
-        unsigned sum = 0;
-        for (unsigned line = y_start; line < y_start + inc_factor; ++line) {
-          auto it_line = _data.begin() + (width() * line) + x_start;
+      unsigned denom = 1;
+      while (denom < 8 && denom * 2 <= factor)
+        denom *= 2;
 
-          sum += std::accumulate(it_line, it_line + inc_factor, 0);
+      auto preview = std::make_shared<Image>();
+      jpeg::load_file(filename, preview->_data, preview->_size.width, preview->_size.height, preview->_ppi, denom);
+      preview->_mode = Grayscale;
+
+      if (factor > denom)
+        return preview->Scale((float) denom / factor);
+      return preview;
+    }
+
+    std::vector<std::shared_ptr<Image>> Image::ReadClips(const std::string &filename, std::vector<Clip> clips) {
+      std::vector<std::shared_ptr<Image>> result;
+
+      if (extension(filename) != Format::PNG) {
+        Image image(filename);
+        for (auto &clip : clips)
+          result.push_back(image.Cut(clip));
+        return result;
+      }
+
+      // Only the rows inside a clip are copied, the rest of the decoded rows are dropped. A turned
+      // clip is copied with the box around it and resampled from it.
+      std::vector<Clip> bounds;
+      for (auto &clip : clips)
+        bounds.push_back(clip.Bounds());
+      std::vector<std::vector<Pixel>> clip_data(clips.size());
+      unsigned image_width = 0, image_ppi = 0;
+      png::read_rows(filename,
+                     [&](unsigned w, unsigned h, unsigned ppi) {
+                       image_width = w;
+                       image_ppi = ppi;
+                       for (unsigned i = 0; i < clips.size(); ++i)
+                         clip_data[i].reserve(bounds[i].length());
+                     },
+                     [&](const Pixel *row, unsigned y) {
+                       for (unsigned i = 0; i < clips.size(); ++i) {
+                         auto &clip = bounds[i];
+                         if (y < clip.top() || y >= clip.bottom())
+                           continue;
+
+                         unsigned left = std::min(clip.left(), image_width);
+                         unsigned right = std::min(clip.left() + clip.width(), image_width);
+                         clip_data[i].insert(clip_data[i].end(), row + left, row + right);
+                         clip_data[i].resize(clip_data[i].size() + clip.width() - (right - left), WHITE_GRAYSCALE);
+                       }
+                     });
+
+      for (unsigned i = 0; i < clips.size(); ++i) {
+        clip_data[i].resize(bounds[i].length(), WHITE_GRAYSCALE);
+        result.push_back(std::make_shared<Image>(std::move(clip_data[i]), bounds[i].size(), Grayscale));
+        result.back()->set_ppi(image_ppi);
+
+        if (clips[i].angle() != 0) {
+          Clip inside(clips[i].left() - bounds[i].left(), clips[i].right() - bounds[i].left(),
+                      clips[i].top() - bounds[i].top(), clips[i].bottom() - bounds[i].top());
+          inside.set_angle(clips[i].angle());
+          result.back() = result.back()->Cut(inside);
+        }
+      }
+
+      return result;
+    }
+
+    BoxDownsampler::BoxDownsampler(Size size, float factor, ColorMode mode):
+      _size(size), _mode(mode) {
+      _scaled_size.height = (unsigned) sround((float) size.height * factor);
+      _scaled_size.width = (unsigned) sround((float) size.width * factor);
+      _factor = (unsigned) round(1.0 / factor);
+
+      if (_factor == 0)
+        throw std::invalid_argument("Invalid scale factor");
+
+      _sum.resize(_scaled_size.width, 0);
+      _data.resize(_scaled_size.width * _scaled_size.height, 0);
+      _histogram.resize(WHITE_GRAYSCALE + 1, 0);
+    }
+
+    void BoxDownsampler::AddRow(const Pixel *row) {
+      unsigned line = _row / _factor;
+
+      if (line < _scaled_size.height) {
+        for (unsigned x = 0; x < _scaled_size.width; ++x) {
+          unsigned end = std::min((x + 1) * _factor, _size.width);
+          for (unsigned i = x * _factor; i < end; ++i)
+            _sum[x] += row[i];
+        }
+
+        // Last row of the band
+        if (_row % _factor == _factor - 1 || _row + 1 == _size.height) {
+          unsigned rows = _row % _factor + 1;
+          auto value = _data.begin() + line * _scaled_size.width;
+
+          for (unsigned x = 0; x < _scaled_size.width; ++x, ++value) {
+            unsigned start = std::min(x * _factor, _size.width);
+            unsigned count = rows * (std::min(start + _factor, _size.width) - start);
+
+            *value = (Pixel) (count ? _sum[x] / count : 0);
+            ++_histogram[*value];
+            _sum[x] = 0;
+          }
         }
-        value = (Pixel) (sum / (inc_factor * inc_factor));
-        ++index;
       }
 
-      return std::make_shared<Image>(new_data, w, h, _mode);
+      ++_row;
+    }
+
+    std::shared_ptr<Image> BoxDownsampler::image() {
+      return std::make_shared<Image>(std::move(_data), _scaled_size, _mode);
+    }
+
+    std::shared_ptr<parallel::ThreadPool> Image::_thread_pool;
+
+    void Image::ForEachBand(const Band &band) {
+      unsigned threads = _thread_pool ? _thread_pool->size() : 1;
+      unsigned count = (threads > 1) ? std::max(1u, std::min(threads * 4, height() / MINIMUM_BAND_ROWS)) : 1;
+      auto stage = memstats::current();
+      auto run = [&](unsigned index) {
+        memstats::Charge charge(stage);
+        band(height() * index / count, height() * (index + 1) / count);
+      };
+
+      if (count == 1)
+        run(0);
+      else
+        _thread_pool->Run(count, run);
     }
 
     void Image::ApplyBinarizedFilter(unsigned umbral) {
+      ApplyThreshold(MeanThreshold(histogram(), umbral));
+    }
+
+    void Image::ApplyThreshold(unsigned threshold) {
+      _mode = Binary;
+      ForEachBand([&](unsigned y0, unsigned y1) {
+        for (auto it = _data.begin() + y0 * width(); it < _data.begin() + y1 * width(); ++it)
+          *it = (*it > threshold) ? white() : black();
+      });
+    }
+
+    Histogram Image::histogram() {
+      Histogram result(WHITE_GRAYSCALE + 1, 0);
+
+      for (auto value : _data)
+        ++result[value];
+
+      return result;
+    }
+
+    unsigned Image::MeanThreshold(const Histogram &histogram, unsigned umbral) {
       const unsigned max_black = 30;
-      unsigned mean = 0, count = 0;
+      unsigned long long sum = 0, count = 0;
 
-      //average calc
-      for (auto &value : _data) {
-        if (value > max_black) {
-          mean += value;
-          count++;
+      for (unsigned value = max_black + 1; value < histogram.size(); ++value) {
+        sum += (unsigned long long) value * histogram[value];
+        count += histogram[value];
+      }
+
+      return (count != 0 ? (unsigned) (sum / count) : 0) + umbral;
+    }
+
+    unsigned Image::OtsuThreshold(const Histogram &histogram) {
+      double total = 0, sum = 0;
+      for (unsigned value = 0; value < histogram.size(); ++value) {
+        total += histogram[value];
+        sum += (double) value * histogram[value];
+      }
+
+      double below = 0, below_sum = 0, best_variance = 0;
+      unsigned threshold = 0;
+      for (unsigned value = 0; value < histogram.size(); ++value) {
+        below += histogram[value];
+        below_sum += (double) value * histogram[value];
+        double above = total - below;
+        if (below == 0)
+          continue;
+        if (above == 0)
+          break;
+
+        double mean_difference = below_sum / below - (sum - below_sum) / above;
+        double variance = below * above * mean_difference * mean_difference;
+        if (variance > best_variance) {
+          best_variance = variance;
+          threshold = value;
         }
       }
-      mean = (count != 0) ? mean / count : 0;
 
-      _mode = Binary;
-      for (auto &pixel : _data) pixel = (pixel > (mean + umbral)) ? white() : black();
+      return threshold;
+    }
+
+    Clip Clip::Bounds() {
+      if (_angle == 0)
+        return *this;
+
+      float radians = _angle * M_PI / 180, sine = fabs(sin(radians)), cosine = fabs(cos(radians));
+      float center_x = (_left + _right) / 2.0, center_y = (_top + _bottom) / 2.0;
+      float half_width = (width() * cosine + height() * sine) / 2, half_height = (width() * sine + height() * cosine) / 2;
+
+      return Clip((unsigned) std::max(0.0f, floorf(center_x - half_width)), (unsigned) ceilf(center_x + half_width) + 1,
+                  (unsigned) std::max(0.0f, floorf(center_y - half_height)), (unsigned) ceilf(center_y + half_height) + 1);
+    }
+
+    std::shared_ptr<Image> Image::Resample(Clip clip, bool nearest) {
+      float radians = clip.angle() * M_PI / 180, sine = sin(radians), cosine = cos(radians);
+      float center_x = (clip.left() + clip.right()) / 2.0, center_y = (clip.top() + clip.bottom()) / 2.0;
+      const unsigned clip_width = clip.width(), clip_height = clip.height();
+      std::vector<Pixel> new_data(clip.length());
+
+      auto at = [&](int x, int y) -> unsigned {
+        if (x < 0 || y < 0 || x >= (int) width() || y >= (int) height())
+          return white();
+        return _data[XY2Index(x, y)];
+      };
+
+      auto out = new_data.begin();
+      for (unsigned v = 0; v < clip_height; ++v) {
+        for (unsigned u = 0; u < clip_width; ++u, ++out) {
+          // Centers of the pixels, turned around the center of the clip
+          float dx = u + 0.5f - clip_width / 2.0f, dy = v + 0.5f - clip_height / 2.0f;
+          float x = center_x + cosine * dx - sine * dy - 0.5f, y = center_y + sine * dx + cosine * dy - 0.5f;
+
+          if (nearest) {
+            *out = at((int) floorf(x + 0.5f), (int) floorf(y + 0.5f));
+            continue;
+          }
+
+          int x0 = (int) floorf(x), y0 = (int) floorf(y);
+          float fx = x - x0, fy = y - y0;
+          float top = at(x0, y0) * (1 - fx) + at(x0 + 1, y0) * fx;
+          float bottom = at(x0, y0 + 1) * (1 - fx) + at(x0 + 1, y0 + 1) * fx;
+          *out = (Pixel) (top * (1 - fy) + bottom * fy + 0.5f);
+        }
+      }
+
+      auto image = std::make_shared<Image>(std::move(new_data), clip.size(), _mode);
+      image->set_ppi(_ppi);
+      return image;
+    }
+
+    std::shared_ptr<Image> Image::Rotate(float degrees) {
+      Clip whole(0, width(), 0, height());
+      whole.set_angle(degrees);
+      return Resample(whole, true);
     }
 
     std::shared_ptr<Image> Image::Cut(Clip clip) {
+      if (clip.angle() != 0)
+        return Resample(clip, _mode == Binary);
+
       std::vector<Pixel> new_data;
 
       for (unsigned line = clip.top(); line < clip.bottom(); ++line) {
@@ -157,147 +462,224 @@ namespace fpcard_slicer {
         new_data.insert(new_data.end(), vector_line.begin(), vector_line.end());
       }
 
-      return std::make_shared<Image>(new_data, clip.width(), clip.height(), _mode);
+      auto image = std::make_shared<Image>(new_data, clip.width(), clip.height(), _mode);
+      image->set_ppi(_ppi);
+      return image;
     }
 
     void Image::ApplyAverageFilter(unsigned bw, unsigned bh) {
-      std::vector<Pixel> new_data(_data.begin(), _data.end());
-      int midblock_h = (int) floor(bh / 2.0);
-      int midblock_w = (int) floor(bw / 2.0);
-      int block_h = midblock_h * 2;
-      int block_w = midblock_w * 2;
-      auto block_size = (double) (block_h * block_w);
+      AverageFilter(Window(bw, bh));
+    }
 
-      unsigned index = 0;
-      for (auto &value : new_data) {
-        int y_start = index / width() - midblock_h;
-        int x_start = index % width() - midblock_w;
-        int y_end = y_start + block_h;
-        int x_end = x_start + block_w;
-
-        if (y_start >= 0 && y_end < height() && x_start >= 0 && x_end < width()) {
-          int sum = 0;
-          for (int line = y_start; line <= y_end; ++line) {
-            sum = std::accumulate(_data.begin() + (width() * line) + x_start,
-                                  _data.begin() + (width() * line) + x_end, sum);
-          }
+    void Image::ApplyVerticalFilter(unsigned bw, unsigned bh) {
+      VerticalFilter(Window(bw, bh));
+    }
 
-          value = (sum / block_size > white() / 2.0) ? white() : black();
-        }
+    void Image::ApplyHorizontalWhiteFilter(unsigned bw, unsigned bh) {
+      HorizontalFilter(Window(bw, bh), white());
+    }
 
-        ++index;
-      }
+    void Image::ApplyHorizontalBlackFilter(unsigned bw, unsigned bh) {
+      HorizontalFilter(Window(bw, bh), black());
+    }
 
-      Clear();
-      _data.insert(_data.end(), new_data.begin(), new_data.end());
+    template<unsigned BW, unsigned BH>
+    void Image::ApplyAverageFilter() {
+      AverageFilter(FixedWindow<BW, BH>());
     }
 
-    void Image::ApplyVerticalFilter(unsigned bw, unsigned bh) {
+    template<unsigned BW, unsigned BH>
+    void Image::ApplyVerticalFilter() {
+      VerticalFilter(FixedWindow<BW, BH>());
+    }
+
+    template<unsigned BW, unsigned BH>
+    void Image::ApplyHorizontalWhiteFilter() {
+      HorizontalFilter(FixedWindow<BW, BH>(), white());
+    }
+
+    template<unsigned BW, unsigned BH>
+    void Image::ApplyHorizontalBlackFilter() {
+      HorizontalFilter(FixedWindow<BW, BH>(), black());
+    }
+
+    // The block covers rows [y - midblock_h, y + midblock_h] and columns
+    // [x - midblock_w, x + midblock_w), only pixels with the whole block inside are evaluated
+    template<typename W>
+    void Image::AverageFilter(const W &window) {
+      const int midblock_h = window.mid_h;
+      const int midblock_w = window.mid_w;
+      const int block_h = midblock_h * 2;
+      const int block_w = midblock_w * 2;
+      const int block_size = block_h * block_w;
+      const int w = width(), h = height();
       std::vector<Pixel> new_data(_data.begin(), _data.end());
-      int midblock_h = (int) floor(bh / 2.0);
-      int midblock_w = (int) floor(bw / 2.0);
-      int block_h = midblock_h * 2;
-      int block_w = midblock_w * 2;
-
-      for (unsigned index = 0; index < length(); ++index) {
-        int y_start = index / width() - midblock_h;
-        int x_start = index % width() - midblock_w;
-        int y_end = y_start + block_h;
-        int x_end = x_start + block_w;
-
-        if (y_start >= 0 && y_end < height() && x_start >= 0 && x_end < width()) {
-
-          int lsum = 0;
-          int rsum = 0;
-          for (int y = y_start; y <= y_end; ++y) {
-            lsum += pixel((unsigned) x_start, (unsigned) y);
-            rsum += pixel((unsigned) x_end, (unsigned) y);
-          }
 
-          if ((lsum + rsum) == block_h * 2) {
-            for (int line = y_start; line < y_end; ++line) {
-              for (auto it = new_data.begin() + (width() * line) + x_start;
-                   it < new_data.begin() + (width() * line) + x_end; ++it)
-                *it = white();
-            }
+      ForEachBand([&](int y0, int y1) {
+        for (int y = std::max(y0, midblock_h); y < y1 && y + midblock_h < h; ++y) {
+          for (int x = midblock_w; x + midblock_w < w; ++x) {
+            const Pixel *line = _data.data() + (y - midblock_h) * w + x - midblock_w;
+
+            int sum = 0;
+            for (int row = 0; row <= block_h; ++row, line += w)
+              for (int col = 0; col < block_w; ++col)
+                sum += line[col];
+
+            // sum / block_size > white / 2
+            new_data[y * w + x] = (2 * sum > white() * block_size) ? white() : black();
           }
         }
-      }
+      });
 
-      Clear();
-      _data.insert(_data.end(), new_data.begin(), new_data.end());
+      _data.swap(new_data);
     }
 
-    void Image::ApplyHorizontalWhiteFilter(unsigned bw, unsigned bh) {
+    // Blocks to paint are marked in a 2D difference array of (width + 1) x (rows + 1),
+    // so the cost of a hit does not depend on the block size
+    static inline void MarkBlock(std::vector<int> &marks, int stride, int x, int y, int bw, int bh) {
+      marks[y * stride + x] += 1;
+      marks[y * stride + x + bw] -= 1;
+      marks[(y + bh) * stride + x] -= 1;
+      marks[(y + bh) * stride + x + bw] += 1;
+    }
+
+    static void PaintBlocks(Pixel *data, int w, int rows, const std::vector<int> &marks, Pixel color) {
+      const int stride = w + 1;
+      std::vector<int> cover(w, 0);
+
+      for (int y = 0; y < rows; ++y) {
+        const int *line = marks.data() + y * stride;
+        int run = 0;
+        for (int x = 0; x < w; ++x) {
+          run += line[x];
+          cover[x] += run;
+          if (cover[x] > 0)
+            data[y * w + x] = color;
+        }
+      }
+    }
+
+    // A band of rows [y0, y1) evaluates the centers whose block reaches it (the halo)
+    // and paints only its own rows, so the bands give the same result as a single pass
+    template<typename W>
+    void Image::VerticalFilter(const W &window) {
+      const int midblock_h = window.mid_h;
+      const int midblock_w = window.mid_w;
+      const int block_h = midblock_h * 2;
+      const int block_w = midblock_w * 2;
+      const int w = width(), h = height();
+
+      if (block_h == 0 || block_w == 0 || block_h >= h || block_w >= w)
+        return;
+
+      const Pixel *data = _data.data();
       std::vector<Pixel> new_data(_data.begin(), _data.end());
-      int midblock_h = (int) floor(bh / 2.0);
-      int midblock_w = (int) floor(bw / 2.0);
-      int block_h = midblock_h * 2;
-      int block_w = midblock_w * 2;
-
-      for (unsigned index = 0; index < length(); ++index) {
-        int y_start = index / width() - midblock_h;
-        int x_start = index % width() - midblock_w;
-        int y_end = y_start + block_h;
-        int x_end = x_start + block_w;
-
-        if (y_start >= 0 && y_end < height() && x_start >= 0 && x_end < width()) {
-          int lsum = std::accumulate(_data.begin() + y_start * width() + x_start,
-                                     _data.begin() + y_start * width() + x_end, 0);
-          int rsum = std::accumulate(_data.begin() + (y_start + block_h) * width() + x_start,
-                                     _data.begin() + (y_start + block_h) * width() + x_end, 0);
-
-          if ((lsum + rsum) == block_w * 2) {
-            for (int line = y_start; line < y_end; ++line) {
-              for (auto it = new_data.begin() + (width() * line) + x_start;
-                   it < new_data.begin() + (width() * line) + x_end; ++it)
-                *it = white();
-            }
+
+      ForEachBand([&](int y0, int y1) {
+        const int first = std::max(midblock_h, y0 - midblock_h + 1);
+        const int last = std::min(h - midblock_h, y1 + midblock_h);
+
+        if (first >= last)
+          return;
+
+        // Column sums over rows [y - midblock_h, y + midblock_h], slid down one row at a time
+        std::vector<int> column(w, 0);
+        for (int row = first - midblock_h; row <= first + midblock_h; ++row)
+          for (int x = 0; x < w; ++x)
+            column[x] += data[row * w + x];
+
+        std::vector<int> marks((w + 1) * (y1 - y0 + 1), 0);
+        for (int y = first; y < last; ++y) {
+          if (y > first) {
+            const Pixel *out = data + (y - midblock_h - 1) * w;
+            const Pixel *in = data + (y + midblock_h) * w;
+            for (int x = 0; x < w; ++x)
+              column[x] += in[x] - out[x];
+          }
+
+          const int top = std::max(y - midblock_h, y0);
+          const int bottom = std::min(y + midblock_h, y1);
+          for (int x = midblock_w; x + midblock_w < w; ++x) {
+            if (column[x - midblock_w] + column[x + midblock_w] == block_h * 2)
+              MarkBlock(marks, w + 1, x - midblock_w, top - y0, block_w, bottom - top);
           }
         }
-      }
 
-      Clear();
-      _data.insert(_data.end(), new_data.begin(), new_data.end());
+        PaintBlocks(new_data.data() + y0 * w, w, y1 - y0, marks, white());
+      });
+
+      _data.swap(new_data);
     }
 
-    void Image::ApplyHorizontalBlackFilter(unsigned bw, unsigned bh) {
+    template<typename W>
+    void Image::HorizontalFilter(const W &window, Pixel color) {
+      const int midblock_h = window.mid_h;
+      const int midblock_w = window.mid_w;
+      const int block_h = midblock_h * 2;
+      const int block_w = midblock_w * 2;
+      const int w = width(), h = height(), stride = w + 1;
+      // Top and bottom rows of the block must be all white (or all black)
+      const int expected = (color == black()) ? 0 : block_w * 2;
+
+      if (block_h == 0 || block_w == 0 || block_h >= h || block_w >= w)
+        return;
+
       std::vector<Pixel> new_data(_data.begin(), _data.end());
-      int midblock_h = (int) floor(bh / 2.0);
-      int midblock_w = (int) floor(bw / 2.0);
-      int block_h = midblock_h * 2;
-      int block_w = midblock_w * 2;
-
-      for (unsigned index = 0; index < length(); ++index) {
-        int y_start = index / width() - midblock_h;
-        int x_start = index % width() - midblock_w;
-        int y_end = y_start + block_h;
-        int x_end = x_start + block_w;
-
-        if (y_start >= 0 && y_end < height() && x_start >= 0 && x_end < width()) {
-          int lsum = std::accumulate(_data.begin() + y_start * width() + x_start,
-                                     _data.begin() + y_start * width() + x_end, 0);
-          int rsum = std::accumulate(_data.begin() + (y_start + block_h) * width() + x_start,
-                                     _data.begin() + (y_start + block_h) * width() + x_end, 0);
-
-          lsum = block_w - lsum;
-          rsum = block_w - rsum;
-
-          if ((lsum + rsum) == block_w * 2) {
-            for (int line = y_start; line < y_end; ++line) {
-              for (auto it = new_data.begin() + (width() * line) + x_start;
-                   it < new_data.begin() + (width() * line) + x_end; ++it)
-                *it = black();
-            }
+
+      ForEachBand([&](int y0, int y1) {
+        const int first = std::max(midblock_h, y0 - midblock_h + 1);
+        const int last = std::min(h - midblock_h, y1 + midblock_h);
+
+        if (first >= last)
+          return;
+
+        // Running sums of the rows read by the band, the sum of columns [0, x) is at x
+        const int row0 = first - midblock_h;
+        const int rows = last + midblock_h - row0;
+        std::vector<int> prefix(rows * stride, 0);
+        for (int row = 0; row < rows; ++row) {
+          const Pixel *line = _data.data() + (row0 + row) * w;
+          int *sum = prefix.data() + row * stride;
+          for (int x = 0; x < w; ++x)
+            sum[x + 1] = sum[x] + line[x];
+        }
+
+        std::vector<int> marks(stride * (y1 - y0 + 1), 0);
+        for (int y = first; y < last; ++y) {
+          const int *top_sum = prefix.data() + (y - midblock_h - row0) * stride;
+          const int *bottom_sum = top_sum + block_h * stride;
+          const int top = std::max(y - midblock_h, y0);
+          const int bottom = std::min(y + midblock_h, y1);
+
+          for (int x = midblock_w; x + midblock_w < w; ++x) {
+            int sum = top_sum[x + midblock_w] - top_sum[x - midblock_w] +
+                      bottom_sum[x + midblock_w] - bottom_sum[x - midblock_w];
+
+            if (sum == expected)
+              MarkBlock(marks, stride, x - midblock_w, top - y0, block_w, bottom - top);
           }
         }
-      }
 
-      Clear();
-      _data.insert(_data.end(), new_data.begin(), new_data.end());
+        PaintBlocks(new_data.data() + y0 * w, w, y1 - y0, marks, color);
+      });
+
+      _data.swap(new_data);
     }
 
+    // Blocks used by Slicer::ApplyFilters
+    template void Image::ApplyAverageFilter<5, 5>();
+    template void Image::ApplyAverageFilter<5, 9>();
+    template void Image::ApplyVerticalFilter<3, 7>();
+    template void Image::ApplyVerticalFilter<7, 7>();
+    template void Image::ApplyVerticalFilter<11, 7>();
+    template void Image::ApplyVerticalFilter<15, 7>();
+    template void Image::ApplyHorizontalWhiteFilter<7, 11>();
+    template void Image::ApplyHorizontalBlackFilter<5, 21>();
+
     void Image::ApplyEdgeFilter(unsigned size, Pixel color) {
+      // A window from slicer.ini may be wider than the image, it is then painted whole
+      size = std::min(size, std::min(width(), height()));
+
       //Left
       for (unsigned line = 0; line < height(); ++line) {
         for (auto it = _data.begin() + (width() * line); it < _data.begin() + (width() * line) + size; it++)
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "layout.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    namespace {
+      std::string Trim(const std::string &value) {
+        auto begin = value.find_first_not_of(" \t\r");
+        if (begin == std::string::npos)
+          return "";
+
+        return value.substr(begin, value.find_last_not_of(" \t\r") - begin + 1);
+      }
+
+      float ParsePercent(const std::string &value) {
+        size_t end = 0;
+        float percent = std::stof(value, &end);
+
+        if (Trim(value.substr(end)) != "" || percent < 0 || percent > 100)
+          throw std::invalid_argument("percent between 0 and 100 expected");
+
+        return percent / 100;
+      }
+
+      int ParseInt(const std::string &value) {
+        size_t end = 0;
+        int number = std::stoi(value, &end);
+
+        if (Trim(value.substr(end)) != "")
+          throw std::invalid_argument("integer expected");
+
+        return number;
+      }
+
+      // left, right, top, bottom in percent of the card
+      Region ParseBox(const std::string &value) {
+        std::vector<float> sides;
+        std::stringstream stream(value);
+        std::string side;
+
+        while (std::getline(stream, side, ','))
+          sides.push_back(ParsePercent(side));
+
+        if (sides.size() != 4)
+          throw std::invalid_argument("box needs left, right, top and bottom");
+        if (sides[0] >= sides[1] || sides[2] >= sides[3])
+          throw std::invalid_argument("box is empty");
+
+        return Region{sides[0], sides[1], sides[2], sides[3]};
+      }
+
+      unsigned ParseWindow(const std::string &value) {
+        int size = ParseInt(value);
+
+        if (size <= 0)
+          throw std::invalid_argument("filter window must be greater than 0");
+
+        return (unsigned) size;
+      }
+
+      FilterStep ParseFilterStep(const std::string &value) {
+        std::string step = Trim(value);
+        auto space = step.find_first_of(" \t");
+        if (space == std::string::npos)
+          throw std::invalid_argument("filter " + step + " has no window");
+
+        std::string kind = step.substr(0, space), size = Trim(step.substr(space));
+        if (kind == "edge")
+          return FilterStep{FilterStep::Edge, ParseWindow(size), 0};
+
+        auto times = size.find('x');
+        if (times == std::string::npos)
+          throw std::invalid_argument("filter window WIDTHxHEIGHT expected");
+        unsigned width = ParseWindow(size.substr(0, times)), height = ParseWindow(size.substr(times + 1));
+
+        if (kind == "average")
+          return FilterStep{FilterStep::Average, width, height};
+        if (kind == "vertical")
+          return FilterStep{FilterStep::Vertical, width, height};
+        if (kind == "white")
+          return FilterStep{FilterStep::HorizontalWhite, width, height};
+        if (kind == "black")
+          return FilterStep{FilterStep::HorizontalBlack, width, height};
+
+        throw std::invalid_argument("filter " + kind + " is not average, vertical, white, black or edge");
+      }
+    }
+
+    image::Clip Region::Resolve(image::Size card, float margin) const {
+      auto position = [](float value, unsigned length) {
+        return (unsigned) std::round(std::min(std::max(value, 0.0f), 1.0f) * length);
+      };
+
+      return image::Clip(position(left - margin, card.width), position(right + margin, card.width),
+                         position(top - margin, card.height), position(bottom + margin, card.height));
+    }
+
+    image::Binarization ParseBinarization(const std::string &value) {
+      if (value == "mean")
+        return image::Mean;
+      if (value == "otsu")
+        return image::Otsu;
+
+      throw std::invalid_argument("binarization " + value + " is not mean or otsu");
+    }
+
+    Engine ParseEngine(const std::string &value) {
+      if (value == "filters")
+        return FilterChain;
+      if (value == "components")
+        return Components;
+
+      throw std::invalid_argument("engine " + value + " is not filters or components");
+    }
+
+    std::vector<FilterStep> ParseFilters(const std::string &value) {
+      std::vector<FilterStep> filters;
+      std::stringstream stream(value);
+      std::string step;
+
+      while (std::getline(stream, step, ','))
+        filters.push_back(ParseFilterStep(step));
+
+      if (filters.empty())
+        throw std::invalid_argument("filters has no step");
+
+      return filters;
+    }
+
+    SlicerSettings ReadSlicerSettings(const std::string &path) {
+      SlicerSettings settings;
+      std::ifstream in(path);
+      std::string line, section;
+      Layout *layout = nullptr;
+      int fp_number = -1;
+      unsigned number = 0;
+
+      if (!in)
+        throw std::invalid_argument("Could not open " + path);
+
+      auto check_fp_number = [&]() {
+        if (layout && fp_number >= 0 && (unsigned) fp_number != layout->boxes.size())
+          throw std::invalid_argument("layout " + layout->name + " has " + std::to_string(layout->boxes.size()) +
+                                      " boxes, fp_number is " + std::to_string(fp_number));
+        if (layout && layout->boxes.empty())
+          throw std::invalid_argument("layout " + layout->name + " has no box");
+      };
+
+      try {
+        while (std::getline(in, line)) {
+          ++number;
+          line = Trim(line.substr(0, line.find_first_of(";#")));
+          if (line.empty())
+            continue;
+
+          if (line.front() == '[' && line.back() == ']') {
+            check_fp_number();
+            section = Trim(line.substr(1, line.size() - 2));
+            layout = nullptr;
+            fp_number = -1;
+
+            if (section.compare(0, 7, "layout ") == 0) {
+              std::string name = Trim(section.substr(7));
+              if (settings.layouts.count(name))
+                throw std::invalid_argument("layout " + name + " is repeated");
+              layout = &settings.layouts[name];
+              layout->name = name;
+            }
+            else if (section != "general") {
+              throw std::invalid_argument("unknown section " + section);
+            }
+            continue;
+          }
+
+          auto equal = line.find('=');
+          if (equal == std::string::npos || section.empty())
+            throw std::invalid_argument("key = value expected");
+
+          std::string key = Trim(line.substr(0, equal)), value = Trim(line.substr(equal + 1));
+
+          if (!layout && key == "fp_number")
+            settings.fp_number = ParseInt(value);
+          else if (!layout && key == "bin_umbral")
+            settings.bin_umbral = ParseInt(value);
+          else if (!layout && key == "binarization")
+            settings.binarization = ParseBinarization(value);
+          else if (!layout && key == "engine")
+            settings.engine = ParseEngine(value);
+          else if (!layout && key == "filters")
+            settings.filters = ParseFilters(value);
+          else if (!layout && key == "layout")
+            settings.layout = value;
+          else if (layout && key == "fp_number")
+            fp_number = ParseInt(value);
+          else if (layout && key == "bin_umbral")
+            layout->bin_umbral = ParseInt(value);
+          else if (layout && key == "binarization")
+            layout->binarization = ParseBinarization(value);
+          else if (layout && key == "engine")
+            layout->engine = ParseEngine(value);
+          else if (layout && key == "filters")
+            layout->filters = ParseFilters(value);
+          else if (layout && key == "margin")
+            layout->margin = ParsePercent(value);
+          else if (layout && key == "box")
+            layout->boxes.push_back(ParseBox(value));
+          else
+            throw std::invalid_argument("unknown key " + key);
+        }
+        check_fp_number();
+      }
+      catch (const std::logic_error &error) {
+        // std::stoi and std::stof throw invalid_argument and out_of_range with the function name only
+        std::string message = error.what();
+        if (message == "stoi" || message == "stof")
+          message = "number expected";
+        throw std::invalid_argument(path + ":" + std::to_string(number) + ": " + message);
+      }
+
+      if (!settings.layout.empty() && !settings.layouts.count(settings.layout))
+        throw std::invalid_argument(path + ": unknown layout " + settings.layout);
+
+      return settings;
+    }
+  }
+}
@@ -4,6 +4,19 @@
 #include <iostream>
 #include <slicer.h>
 #include <parse_arguments.h>
+#include <manifest.h>
+#include <source_stream.h>
+#include <triage.h>
+#include <memstats.h>
+#include <metrics.h>
+#include <scheduler.h>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,11 +32,244 @@ using namespace std;
 using namespace fpcard_slicer::image;
 using namespace fpcard_slicer::slicer;
 using namespace fpcard_slicer::application;
+namespace memstats = fpcard_slicer::memstats;
+namespace metrics = fpcard_slicer::metrics;
 
-std::string GetName(std::string name) {
-  int start = name.rfind('/')+1;
-  int len = name.rfind('.') - start;
-  return name.substr(start, len);
+bool FileExists(const std::string& path) {
+  ManifestEntry entry;
+  return StatFile(path, entry);
+}
+
+// mkdir -p without a shell, the names come from the sources
+void MakeDirectories(const std::string& path) {
+  for(size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+    std::string directory = path.substr(0, slash);
+    struct stat info;
+    if(mkdir(directory.c_str(), 0777) != 0 && (errno != EEXIST || stat(directory.c_str(), &info) != 0 ||
+                                               !S_ISDIR(info.st_mode)))
+      throw std::runtime_error("Could not create " + directory + ": " + std::strerror(errno));
+    if(slash == std::string::npos)
+      break;
+  }
+}
+
+// Every output of count fingerprints, each fingerprint followed by its renditions
+// A missing finger has an empty clip and no output, the others keep their index
+std::vector<std::string> OutputPaths(SlicerConfig& config, const std::string& output_path, std::vector<Clip>& clips) {
+  std::vector<std::string> outputs;
+
+  for(size_t index = 0; index < clips.size(); ++index) {
+    if(clips[index].length() == 0)
+      continue;
+    std::string prefix = output_path + "/fp_" + std::to_string(index);
+    outputs.push_back(prefix + "." + config.output_format());
+    for(auto &rendition : config.renditions())
+      outputs.push_back(prefix + "_" + rendition.name + "." + rendition.format);
+  }
+
+  return outputs;
+}
+
+// Box downsample of a rendition of a card of ppi, the effective resolution of CardPpi
+unsigned RenditionDivisor(const Rendition& rendition, unsigned ppi) {
+  float divisor = 1 / rendition.scale;
+  if(rendition.ppi)
+    divisor = (float) ppi / rendition.ppi;
+
+  return std::max(1u, (unsigned) std::round(divisor));
+}
+
+// Resolution of the scan, the density in the file is only trusted from MINIMUM_PPI on
+unsigned CardPpi(SlicerConfig& config, const Header& header) {
+  return config.resolution() ? config.resolution() : EffectivePpi(header.ppi);
+}
+
+// Size of a saved output for the metrics
+void CountOutput(const std::string& path) {
+  ManifestEntry output;
+  if(metrics::enabled() && StatFile(path, output))
+    metrics::CountWritten(output.size);
+}
+
+// State shared by the cards running at the same time
+struct Batch {
+  explicit Batch(const std::string& manifest_path): manifest(manifest_path) {}
+  std::mutex lock;
+  Manifest manifest;
+  // HashText of the analysis settings of the run
+  std::string settings;
+  // Rejected and flagged cards for the summary
+  std::vector<std::pair<std::string, TriageResult>> triaged;
+  // Cards that threw, with the error
+  std::vector<std::pair<std::string, std::string>> failed;
+
+  // Entries are copied, the manifest changes while the card runs
+  bool Find(const ManifestEntry& entry, ManifestEntry& previous, bool by_content) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto recorded = by_content ? manifest.FindContent(entry) : manifest.Find(entry);
+    if(recorded)
+      previous = *recorded;
+    return recorded != nullptr;
+  }
+  void Add(const ManifestEntry& entry) {
+    std::lock_guard<std::mutex> guard(lock);
+    manifest.Add(entry);
+  }
+  void Triaged(const std::string& source, const TriageResult& triage) {
+    std::lock_guard<std::mutex> guard(lock);
+    triaged.push_back(std::make_pair(source, triage));
+  }
+  void Failed(const std::string& source, const std::string& error) {
+    std::lock_guard<std::mutex> guard(lock);
+    failed.push_back(std::make_pair(source, error));
+    std::cerr << source << " FAILED (" << error << ")" << endl;
+  }
+};
+
+// The lines of a card are printed together, cards may finish in any order
+void PrintCard(SlicerConfig& config, Batch& batch, std::ostringstream& log) {
+  // Allocations can only be told apart by card when they run one at a time
+  if(memstats::enabled() && config.cards() == 1)
+    memstats::Print(log, memstats::TakeCard(), "    ");
+
+  std::lock_guard<std::mutex> guard(batch.lock);
+  std::cout << log.str() << std::flush;
+}
+
+// PNG cards are streamed, only the thumbnail and the clipped rows are kept in memory
+std::vector<std::shared_ptr<Image>> SliceCard(Slicer& slicer, SlicerConfig& config, const std::string& source,
+                                              unsigned ppi, const std::string& partial_out,
+                                              std::vector<Clip>& clip_list, TriageResult& triage) {
+  std::vector<std::shared_ptr<Image>> fingerprints;
+  unsigned factor = slicer.ScaleFactor(ppi);
+
+  if(Image::extension(source) == Format::PNG) {
+    metrics::StageScope stage(memstats::Decode);
+    Histogram histogram;
+    auto thumbnail = Image::ReadScaled(source, 1.0 / factor, &histogram);
+    if(config.triage()) {
+      stage.Switch(memstats::Triage);
+      if((triage = Triage(thumbnail, histogram)).verdict == Rejected)
+        return fingerprints;
+    }
+    stage.Switch(memstats::Other);
+    clip_list = slicer.CalculateScaledSlice(thumbnail, factor, histogram, partial_out);
+    stage.Switch(memstats::Decode);
+    fingerprints = Image::ReadClips(source, clip_list);
+  }
+  else {
+    // The preview is decoded at reduced size, a rejected card is never fully decoded
+    if(config.triage()) {
+      metrics::StageScope stage(memstats::Triage);
+      auto preview = Image::ReadPreview(source, factor);
+      if((triage = Triage(preview)).verdict == Rejected)
+        return fingerprints;
+    }
+    metrics::StageScope stage(memstats::Decode);
+    auto fpcard = std::make_shared<Image>(source);
+    fpcard->set_ppi(ppi);
+    stage.Switch(memstats::Other);
+    clip_list = slicer.CalculateSlice(fpcard, ppi, partial_out);
+    stage.Switch(memstats::Crop);
+    for(auto &clip : clip_list)
+      fingerprints.push_back(fpcard->Cut(clip));
+  }
+
+  return fingerprints;
+}
+
+metrics::Result ProcessCard(Slicer& slicer, SlicerConfig& config, Batch& batch, const Source& next) {
+  const std::string &source = next.path;
+  std::string output_path = config.destination() + "/" + next.name;
+  std::ostringstream log;
+  MakeDirectories(output_path);
+  log << output_path << " ... ";
+
+  ManifestEntry entry, previous;
+  entry.source = CanonicalPath(source);
+  entry.settings = batch.settings;
+  StatFile(source, entry);
+
+  bool found = batch.Find(entry, previous, false);
+  std::vector<std::string> outputs;
+  if(found)
+    outputs = OutputPaths(config, output_path, previous.clips);
+
+  // Unchanged card with every output in place
+  if(found && !config.force() && outputs == previous.outputs &&
+     std::all_of(outputs.begin(), outputs.end(), FileExists)) {
+    log << " SKIP" << endl;
+    PrintCard(config, batch, log);
+    return metrics::Skipped;
+  }
+  metrics::CountRead(entry.size);
+
+  entry.hash = HashFile(source);
+  if(!found)
+    found = batch.Find(entry, previous, true);
+
+  // The outputs carry the resolution of the analysis, not the raw density of the file
+  unsigned ppi = CardPpi(config, Image::ReadHeader(source));
+  std::string partial_out = config.demo_mode()?output_path:"";
+  std::vector<std::shared_ptr<Image>> fingerprints;
+  TriageResult triage;
+
+  if(found && !config.force()) {
+    // Same content already sliced, only the crops are taken again
+    entry.clips = previous.clips;
+    metrics::StageScope stage(memstats::Decode);
+    fingerprints = Image::ReadClips(source, entry.clips);
+  }
+  else {
+    fingerprints = SliceCard(slicer, config, source, ppi, partial_out, entry.clips, triage);
+  }
+
+  if(triage.verdict != Accepted)
+    batch.Triaged(source, triage);
+
+  if(triage.verdict == Rejected) {
+    log << " REJECTED (" << triage.reason << ")" << endl;
+    PrintCard(config, batch, log);
+    return metrics::Rejected;
+  }
+
+  //Save result
+  entry.outputs = OutputPaths(config, output_path, entry.clips);
+  auto out = entry.outputs.begin();
+  std::string missing;
+  for(size_t index = 0; index < fingerprints.size(); ++index) {
+    if(entry.clips[index].length() == 0) {
+      missing += (missing.empty() ? "" : ", ") + std::to_string(index);
+      continue;
+    }
+    auto &fingerprint = fingerprints[index];
+    fingerprint->set_ppi(ppi);
+    metrics::StageScope stage(memstats::Encode);
+    fingerprint->Save(*out, config.save_options());
+    CountOutput(*out++);
+
+    // Renditions come from the same crop, reduced like the analysis thumbnail
+    for(auto &rendition : config.renditions()) {
+      unsigned divisor = RenditionDivisor(rendition, ppi);
+      auto reduced = (divisor > 1) ? fingerprint->Scale(1.0 / divisor) : fingerprint;
+      reduced->set_ppi(ppi / divisor);
+      reduced->Save(*out, rendition.save_options);
+      CountOutput(*out++);
+    }
+  }
+
+  batch.Add(entry);
+  if(found && !config.force() && previous.source != entry.source)
+    log << " OK (duplicate of " << previous.source << ")";
+  else if(triage.verdict == Flagged)
+    log << " OK (flagged: " << triage.reason << ")";
+  else
+    log << " OK";
+  if(!missing.empty())
+    log << " (no fingerprint " << missing << ")";
+  log << endl;
+  PrintCard(config, batch, log);
+  return metrics::Done;
 }
 
 int main(int argc, char** argv) {
@@ -33,26 +279,126 @@ int main(int argc, char** argv) {
     return -1;
   }
 
-  //TODO: add slicer.ini
-  Slicer slicer(10, 1, Mode::General, 20);
+  SlicerSettings settings;
+  try {
+    if(!config.layout_file().empty())
+      settings = ReadSlicerSettings(config.layout_file());
+  }
+  catch(const std::invalid_argument& error) {
+    std::cerr << error.what() << std::endl;
+    return -1;
+  }
 
-  for(auto &source : config.source_list()) {
-    std::string output_path = config.destination() + "/" + GetName(source);
-    system(std::string("mkdir -p " + output_path).c_str());
-    std::cout << output_path << " ... ";
+  std::string layout = config.layout().empty() ? settings.layout : config.layout();
+  if(!layout.empty() && !settings.layouts.count(layout)) {
+    std::cerr << "--layout " << layout << " is not in " << config.layout_file() << std::endl;
+    return -1;
+  }
 
-    auto fpcard = std::make_shared<Image>(source);
-    auto clip_list = slicer.CalculateSlice(fpcard, config.demo_mode()?output_path:"");
+  Slicer slicer = layout.empty() ?
+                  Slicer(settings.fp_number, settings.bin_umbral, Mode::General, 20) :
+                  Slicer(settings.layouts[layout]);
+  if(layout.empty()) {
+    slicer.set_binarization(settings.binarization);
+    slicer.set_engine(settings.engine);
+    slicer.set_filters(settings.filters);
+  }
+  if(!config.binarization().empty())
+    slicer.set_binarization(ParseBinarization(config.binarization()));
+  if(!config.engine().empty())
+    slicer.set_engine(ParseEngine(config.engine()));
+  slicer.set_deskew(config.deskew());
+
+  if(config.memstats())
+    memstats::Enable();
+
+  if(!config.metrics_file().empty())
+    metrics::Start(config.metrics_file());
+
+  if(config.threads() > 1)
+    Image::set_thread_pool(std::make_shared<fpcard_slicer::parallel::ThreadPool>(config.threads()));
+
+  // The outputs are recorded under it, as the sources, to match from any working directory
+  config.set_destination(CanonicalPath(config.destination()));
+  Batch batch(config.destination() + "/" + ManifestName(config.shard(), config.shard_count()));
+  batch.settings = HashText(slicer.Signature() + " resolution " + std::to_string(config.resolution()));
+
+  SourceStream sources(config.source(), config.recursive(), config.source_list_file());
+  Source next;
+  unsigned found = 0, processed = 0;
+  CardScheduler scheduler(config.cards(), config.memory_limit());
 
-    //Save result
-    int index = 0;
-    for(auto &clip : clip_list) {
-      std::string out = output_path + "/fp_" + std::to_string(index++) + "." + config.output_format();
-      (fpcard->Cut(clip))->Save(out, config.output_quality());
+  while(sources.Next(next)) {
+    ++found;
+    if(config.shard_count() > 1 && ShardOf(next, config.shard_count()) != config.shard())
+      continue;
+    ++processed;
+    unsigned long long footprint = 0;
+    if(config.memory_limit()) {
+      // Only the header is read here, the card is decoded once it is admitted
+      try {
+        Header header = Image::ReadHeader(next.path);
+        unsigned factor = slicer.ScaleFactor(CardPpi(config, header));
+        footprint = EstimateFootprint(Image::extension(next.path), header, factor);
+      }
+      catch(const std::exception&) {
+        // The card fails again when it runs, and is reported there
+      }
     }
+    metrics::CardQueued();
+    scheduler.Submit(footprint, [&, next]() {
+      auto started = metrics::Clock::now();
+      metrics::CardStarted();
+      // A card that throws is reported and the batch goes on
+      try {
+        metrics::CardFinished(ProcessCard(slicer, config, batch, next), started);
+      }
+      catch(const std::exception& error) {
+        batch.Failed(next.path, error.what());
+        metrics::CardFinished(metrics::Failed, started);
+      }
+      catch(...) {
+        batch.Failed(next.path, "unknown error");
+        metrics::CardFinished(metrics::Failed, started);
+      }
+    });
+  }
+  scheduler.Wait();
+  metrics::Stop();
+
+  batch.manifest.Compact();
 
-    std::cout << " OK" << endl;
+  auto &triaged = batch.triaged;
+  if(!triaged.empty()) {
+    auto rejected = std::count_if(triaged.begin(), triaged.end(), [](const std::pair<std::string, TriageResult>& card) {
+      return card.second.verdict == Rejected;
+    });
+    std::cout << "Triage: " << rejected << " rejected, " << triaged.size() - rejected << " flagged" << endl;
+    for(auto &card : triaged)
+      std::cout << (card.second.verdict == Rejected ? "  REJECTED " : "  FLAGGED  ") << card.first << ": "
+                << card.second.reason << endl;
+  }
+
+  if(!batch.failed.empty()) {
+    std::cout << "Failed: " << batch.failed.size() << endl;
+    for(auto &card : batch.failed)
+      std::cout << "  FAILED   " << card.first << ": " << card.second << endl;
+  }
+
+  if(memstats::enabled()) {
+    // Cards running at the same time are only counted for the whole batch
+    memstats::TakeCard();
+    std::cout << "Memory per stage, " << processed << " cards (peak is the highest of any card"
+              << (config.cards() > 1 ? ", with the live memory of the cards running beside it" : "") << "):" << endl;
+    memstats::Print(std::cout, memstats::batch(), "  ");
+  }
+
+  if(found == 0) {
+    std::cerr << "--source is empty of png or jpg images" << std::endl;
+    return -1;
   }
+  if(processed == 0)
+    std::cout << "No source in shard " << config.shard() << "/" << config.shard_count() << endl;
 
-  return 0;
+  return batch.failed.empty() ? 0 : 1;
 }
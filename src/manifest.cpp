@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include "manifest.h"
+
+namespace fpcard_slicer {
+  namespace application {
+    const std::string MANIFEST_HEADER = "# fpcard_slicer manifest 2";
+    // Version 1 had no settings field
+    const std::string MANIFEST_HEADER_1 = "# fpcard_slicer manifest 1";
+    const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+    const unsigned long long FNV_PRIME = 1099511628211ULL;
+
+    namespace {
+      // Paths may hold tabs and newlines, the separators of the manifest
+      std::string Escape(const std::string &value) {
+        std::string escaped;
+        for (char c : value) {
+          if (c == '\\')
+            escaped += "\\\\";
+          else if (c == '\t')
+            escaped += "\\t";
+          else if (c == '\n')
+            escaped += "\\n";
+          else
+            escaped += c;
+        }
+        return escaped;
+      }
+
+      std::string Unescape(const std::string &value) {
+        std::string plain;
+        for (size_t i = 0; i < value.size(); ++i) {
+          if (value[i] != '\\' || i + 1 == value.size()) {
+            plain += value[i];
+            continue;
+          }
+          char c = value[++i];
+          plain += (c == 't') ? '\t' : (c == 'n') ? '\n' : c;
+        }
+        return plain;
+      }
+
+      std::string Hex(unsigned long long hash) {
+        std::ostringstream out;
+        out << std::hex << std::setw(16) << std::setfill('0') << hash;
+        return out.str();
+      }
+    }
+
+    Manifest::Manifest(const std::string &path): _path(path) {
+      bool exists = Load();
+
+      _log.open(_path, std::ios::app);
+      if (!_log)
+        throw std::runtime_error("Could not open " + _path);
+      if (!exists)
+        _log << MANIFEST_HEADER << std::endl;
+      // Entries of an older version are kept with no settings, their cards are sliced again
+      if (_outdated)
+        Compact();
+      _outdated = false;
+    }
+
+    const ManifestEntry *Manifest::Find(const ManifestEntry &entry) {
+      auto it = _entries.find(entry.source);
+
+      if (it == _entries.end() || it->second.size != entry.size || it->second.mtime != entry.mtime ||
+          it->second.settings != entry.settings)
+        return nullptr;
+
+      return &it->second;
+    }
+
+    const ManifestEntry *Manifest::FindContent(const ManifestEntry &entry) {
+      auto it = _content.find(ContentKey(entry));
+
+      if (it == _content.end())
+        return nullptr;
+
+      return &_entries[it->second];
+    }
+
+    void Manifest::Add(const ManifestEntry &entry) {
+      _entries[entry.source] = entry;
+      _content[ContentKey(entry)] = entry.source;
+
+      _log << Format(entry) << std::endl;
+    }
+
+    void Manifest::Compact() {
+      std::string tmp_path = _path + ".tmp";
+      {
+        std::ofstream out(tmp_path, std::ios::trunc);
+        out << MANIFEST_HEADER << "\n";
+        for (auto &item : _entries)
+          out << Format(item.second) << "\n";
+
+        if (!out.flush())
+          throw std::runtime_error("Could not write " + tmp_path);
+      }
+
+      _log.close();
+      if (rename(tmp_path.c_str(), _path.c_str()) != 0)
+        throw std::runtime_error("Could not write " + _path);
+      _log.open(_path, std::ios::app);
+    }
+
+    bool Manifest::Load() {
+      std::ifstream in(_path);
+      std::string line;
+
+      if (!in || in.peek() == std::ifstream::traits_type::eof())
+        return false;
+
+      bool first = true;
+      while (std::getline(in, line)) {
+        ManifestEntry entry;
+
+        if (first && line == MANIFEST_HEADER_1)
+          _outdated = true;
+        first = false;
+
+        // Comments and the line cut by a crash are skipped
+        if (line.empty() || line[0] == '#' || !Parse(line, entry))
+          continue;
+
+        _entries[entry.source] = entry;
+        _content[ContentKey(entry)] = entry.source;
+      }
+
+      return true;
+    }
+
+    // source, size, mtime, hash, settings, clips (left,right,top,bottom[,degrees];...) and outputs separated
+    // by tabs. Tabs, newlines and backslashes of the paths are escaped.
+    std::string Manifest::Format(const ManifestEntry &entry) {
+      std::ostringstream line;
+
+      line << Escape(entry.source) << '\t' << entry.size << '\t' << entry.mtime << '\t' << entry.hash << '\t'
+           << entry.settings << '\t';
+      for (unsigned i = 0; i < entry.clips.size(); ++i) {
+        auto clip = entry.clips[i];
+        line << (i ? ";" : "") << clip.left() << ',' << clip.right() << ',' << clip.top() << ',' << clip.bottom();
+        if (clip.angle() != 0)
+          line << ',' << clip.angle();
+      }
+      for (auto &output : entry.outputs)
+        line << '\t' << Escape(output);
+
+      return line.str();
+    }
+
+    bool Manifest::Parse(const std::string &line, ManifestEntry &entry) {
+      std::vector<std::string> fields;
+      std::istringstream in(line);
+      std::string field;
+
+      while (std::getline(in, field, '\t'))
+        fields.push_back(field);
+
+      // Entries of version 1 keep empty settings, and are sliced again
+      if (_outdated)
+        fields.insert(fields.begin() + 4, "");
+      if (fields.size() < 6)
+        return false;
+
+      try {
+        entry.source = Unescape(fields[0]);
+        entry.size = std::stoull(fields[1]);
+        entry.mtime = std::stoll(fields[2]);
+        entry.hash = fields[3];
+        entry.settings = fields[4];
+      } catch (std::exception &) {
+        return false;
+      }
+
+      std::istringstream clips(fields[5]);
+      std::string item;
+      while (std::getline(clips, item, ';')) {
+        unsigned left, right, top, bottom;
+        float angle = 0;
+        if (sscanf(item.c_str(), "%u,%u,%u,%u,%f", &left, &right, &top, &bottom, &angle) < 4)
+          return false;
+        entry.clips.push_back(image::Clip(left, right, top, bottom));
+        entry.clips.back().set_angle(angle);
+      }
+
+      // The same number of outputs for every clip, one more for each rendition. An empty clip, a
+      // missing finger, has none.
+      for (auto output = fields.begin() + 6; output != fields.end(); ++output)
+        entry.outputs.push_back(Unescape(*output));
+      size_t found = std::count_if(entry.clips.begin(), entry.clips.end(),
+                                   [](image::Clip &clip) { return clip.length() > 0; });
+      return found == 0 ? entry.outputs.empty() : entry.outputs.size() % found == 0;
+    }
+
+    std::string CanonicalPath(const std::string &path) {
+      std::unique_ptr<char, void (*)(void *)> resolved(realpath(path.c_str(), nullptr), free);
+
+      return resolved ? std::string(resolved.get()) : path;
+    }
+
+    bool StatFile(const std::string &path, ManifestEntry &entry) {
+      struct stat info;
+
+      if (stat(path.c_str(), &info) != 0)
+        return false;
+
+      entry.size = (unsigned long long) info.st_size;
+      entry.mtime = (long long) info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+      return true;
+    }
+
+    std::string ManifestName(unsigned shard, unsigned shard_count) {
+      if (shard_count <= 1)
+        return MANIFEST_NAME;
+
+      return "fpcard_slicer.shard-" + std::to_string(shard) + "-of-" + std::to_string(shard_count) + ".manifest";
+    }
+
+    std::string HashFile(const std::string &path) {
+      std::ifstream in(path, std::ios::binary);
+      std::vector<char> buffer(1 << 16);
+      unsigned long long hash = FNV_OFFSET;
+
+      if (!in)
+        throw std::runtime_error("Could not open " + path);
+
+      while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+        for (std::streamsize i = 0; i < in.gcount(); ++i) {
+          hash ^= (unsigned char) buffer[i];
+          hash *= FNV_PRIME;
+        }
+      }
+
+      return Hex(hash);
+    }
+
+    std::string HashText(const std::string &text) {
+      unsigned long long hash = FNV_OFFSET;
+      for (unsigned char c : text) {
+        hash ^= c;
+        hash *= FNV_PRIME;
+      }
+
+      return Hex(hash);
+    }
+  }
+}
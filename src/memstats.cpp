@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <string>
+#include "memstats.h"
+
+#ifdef HAVE_MEMSTATS
+#include <malloc.h>
+#endif
+
+namespace fpcard_slicer {
+  namespace memstats {
+    // Plain arrays, operator new can not allocate to count itself
+    std::atomic<bool> _enabled(false);
+    // Each card runs on its own thread, its allocations are not charged to the stage of another card
+    thread_local int _current = Other;
+    std::atomic<long long> _live(0);
+    std::atomic<unsigned long long> _allocations[STAGE_COUNT];
+    std::atomic<unsigned long long> _bytes[STAGE_COUNT];
+    std::atomic<long long> _peak[STAGE_COUNT];
+    std::vector<Counters> _batch(STAGE_COUNT);
+
+    const char *const STAGE_NAMES[STAGE_COUNT] = {
+      "other", "decode", "scale", "triage", "binarize", "edges", "deskew", "filters", "search", "crop", "encode"
+    };
+
+    void UpdatePeak(int stage, long long live) {
+      long long peak = _peak[stage].load(std::memory_order_relaxed);
+      while (live > peak && !_peak[stage].compare_exchange_weak(peak, live, std::memory_order_relaxed));
+    }
+
+#ifdef HAVE_MEMSTATS
+    // Every block starts with the bytes it was counted for, 0 if it was allocated before Enable
+    const size_t HEADER = alignof(std::max_align_t);
+
+    // Block given by malloc to the pointer given to the caller
+    inline void *CountAllocation(void *block) {
+      if (!block)
+        return nullptr;
+
+      size_t size = 0;
+      if (_enabled.load(std::memory_order_relaxed)) {
+        size = malloc_usable_size(block) - HEADER;
+        _allocations[_current].fetch_add(1, std::memory_order_relaxed);
+        _bytes[_current].fetch_add(size, std::memory_order_relaxed);
+        UpdatePeak(_current, _live.fetch_add(size, std::memory_order_relaxed) + size);
+      }
+
+      *(size_t *) block = size;
+      return (char *) block + HEADER;
+    }
+
+    // Pointer given to the caller to the block to free
+    inline void *CountFree(void *pointer) {
+      if (!pointer)
+        return nullptr;
+
+      void *block = (char *) pointer - HEADER;
+      size_t size = *(size_t *) block;
+      if (size)
+        _live.fetch_sub(size, std::memory_order_relaxed);
+      return block;
+    }
+#endif
+
+    void Enable() {
+      for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        _allocations[stage] = 0;
+        _bytes[stage] = 0;
+        _peak[stage] = 0;
+      }
+      _enabled = true;
+    }
+
+    bool enabled() {
+      return _enabled;
+    }
+
+    const char *name(Stage stage) {
+      return STAGE_NAMES[stage];
+    }
+
+    Stage current() {
+      return (Stage) _current;
+    }
+
+    Scope::Scope(Stage stage): _previous(_current) {
+      Switch(stage);
+    }
+
+    void Scope::Switch(Stage stage) {
+      _current = stage;
+      // A stage without allocations still holds what is live when it starts
+      if (_enabled)
+        UpdatePeak(stage, _live);
+    }
+
+    Scope::~Scope() {
+      _current = _previous;
+    }
+
+    Charge::Charge(Stage stage): _previous(_current) {
+      _current = stage;
+    }
+
+    Charge::~Charge() {
+      _current = _previous;
+    }
+
+    std::vector<Counters> TakeCard() {
+      std::vector<Counters> card(STAGE_COUNT);
+
+      for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        card[stage].allocations = _allocations[stage].exchange(0);
+        card[stage].bytes = _bytes[stage].exchange(0);
+        card[stage].peak = _peak[stage].exchange(0);
+
+        _batch[stage].allocations += card[stage].allocations;
+        _batch[stage].bytes += card[stage].bytes;
+        _batch[stage].peak = std::max(_batch[stage].peak, card[stage].peak);
+      }
+
+      return card;
+    }
+
+    const std::vector<Counters> &batch() {
+      return _batch;
+    }
+
+    void Print(std::ostream &out, const std::vector<Counters> &counters, const std::string &indent) {
+      auto megabytes = [](long long bytes) {
+        return std::to_string(bytes / (1024 * 1024)) + "." + std::to_string(bytes % (1024 * 1024) * 10 / (1024 * 1024))
+               + " MB";
+      };
+
+      for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        if (counters[stage].allocations == 0)
+          continue;
+        out << indent << std::left << std::setw(9) << STAGE_NAMES[stage] << std::right
+            << std::setw(9) << counters[stage].allocations << " allocations "
+            << std::setw(10) << megabytes(counters[stage].bytes) << " allocated, peak "
+            << std::setw(10) << megabytes(counters[stage].peak) << " live" << std::endl;
+      }
+    }
+  }
+}
+
+#ifdef HAVE_MEMSTATS
+using fpcard_slicer::memstats::CountAllocation;
+using fpcard_slicer::memstats::CountFree;
+using fpcard_slicer::memstats::HEADER;
+
+// Replaced in the MEMSTATS build only. Every block pays a header, and every new a relaxed load of
+// the flag even without --memstats. malloc_usable_size is glibc.
+void *operator new(std::size_t size) {
+  void *block = CountAllocation(std::malloc(HEADER + size));
+  if (!block)
+    throw std::bad_alloc();
+  return block;
+}
+
+void *operator new[](std::size_t size) {
+  return ::operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return CountAllocation(std::malloc(HEADER + size));
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept {
+  return ::operator new(size, tag);
+}
+
+void operator delete(void *block) noexcept {
+  std::free(CountFree(block));
+}
+
+void operator delete[](void *block) noexcept {
+  ::operator delete(block);
+}
+
+void operator delete(void *block, const std::nothrow_t &) noexcept {
+  ::operator delete(block);
+}
+
+void operator delete[](void *block, const std::nothrow_t &) noexcept {
+  ::operator delete(block);
+}
+#endif
@@ -0,0 +1,217 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "metrics.h"
+
+namespace fpcard_slicer {
+  namespace metrics {
+    namespace {
+      // Counts per bucket, made cumulative when written
+      struct Histogram {
+        std::atomic<unsigned long long> buckets[BUCKET_COUNT + 1];
+        std::atomic<unsigned long long> nanoseconds;
+
+        void Observe(Clock::time_point started) {
+          auto elapsed = Clock::now() - started;
+          double seconds = std::chrono::duration<double>(elapsed).count();
+          unsigned bucket = 0;
+          while (bucket < BUCKET_COUNT && seconds > LATENCY_BUCKETS[bucket])
+            ++bucket;
+          buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+          nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                                std::memory_order_relaxed);
+        }
+      };
+
+      const char *const RESULT_NAMES[RESULT_COUNT] = {"ok", "skipped", "rejected", "failed"};
+
+      std::atomic<bool> _enabled(false);
+      std::atomic<unsigned long long> _cards[RESULT_COUNT];
+      std::atomic<unsigned long long> _read(0), _written(0);
+      std::atomic<long long> _queued(0), _running(0);
+      Histogram _card_seconds;
+      Histogram _stage_seconds[memstats::STAGE_COUNT];
+      Clock::time_point _start;
+      std::time_t _start_time;
+
+      std::string _path;
+      // Not a static thread, libjpeg calls exit() on a broken file and a joinable thread can not be destroyed
+      std::thread *_writer = nullptr;
+      std::mutex _lock;
+      std::condition_variable _stopped;
+      bool _stop = false;
+
+      void Header(std::ostream &out, const std::string &name, const std::string &type, const std::string &help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+      }
+
+      // labels is empty or ends with a comma
+      void Write(std::ostream &out, const std::string &name, const std::string &labels, Histogram &histogram) {
+        unsigned long long count = 0;
+        for (unsigned bucket = 0; bucket <= BUCKET_COUNT; ++bucket) {
+          count += histogram.buckets[bucket].load(std::memory_order_relaxed);
+          out << name << "_bucket{" << labels << "le=\"";
+          if (bucket < BUCKET_COUNT)
+            out << LATENCY_BUCKETS[bucket];
+          else
+            out << "+Inf";
+          out << "\"} " << count << "\n";
+        }
+
+        std::string plain = labels.empty() ? "" : "{" + labels.substr(0, labels.size() - 1) + "}";
+        out << name << "_sum" << plain << " " << histogram.nanoseconds.load(std::memory_order_relaxed) / 1e9 << "\n"
+            << name << "_count" << plain << " " << count << "\n";
+      }
+
+      void Save() {
+        std::string temporary = _path + ".tmp";
+        {
+          std::ofstream out(temporary);
+          out << Format();
+          if (!out) {
+            std::cerr << "Could not write " << temporary << std::endl;
+            return;
+          }
+        }
+        if (std::rename(temporary.c_str(), _path.c_str()) != 0)
+          std::cerr << "Could not rename " << temporary << " to " << _path << std::endl;
+      }
+
+      void Loop() {
+        std::unique_lock<std::mutex> lock(_lock);
+        while (!_stop) {
+          lock.unlock();
+          Save();
+          lock.lock();
+          _stopped.wait_for(lock, std::chrono::seconds(UPDATE_INTERVAL), [] { return _stop; });
+        }
+      }
+    }
+
+    void Start(const std::string &path) {
+      _path = path;
+      _start = Clock::now();
+      _start_time = std::time(nullptr);
+      _enabled = true;
+      _writer = new std::thread(Loop);
+    }
+
+    void Stop() {
+      if (!_enabled)
+        return;
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+      }
+      _stopped.notify_all();
+      _writer->join();
+      delete _writer;
+      _writer = nullptr;
+      Save();
+      _enabled = false;
+    }
+
+    bool enabled() {
+      return _enabled.load(std::memory_order_relaxed);
+    }
+
+    void CardQueued() {
+      if (enabled())
+        _queued.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void CardStarted() {
+      if (!enabled())
+        return;
+      _queued.fetch_sub(1, std::memory_order_relaxed);
+      _running.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void CardFinished(Result result, Clock::time_point started) {
+      if (!enabled())
+        return;
+      _running.fetch_sub(1, std::memory_order_relaxed);
+      _cards[result].fetch_add(1, std::memory_order_relaxed);
+      // Skipped cards would only measure the manifest lookup
+      if (result != Skipped)
+        _card_seconds.Observe(started);
+    }
+
+    void CountRead(unsigned long long bytes) {
+      if (enabled())
+        _read.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void CountWritten(unsigned long long bytes) {
+      if (enabled())
+        _written.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void ObserveStage(memstats::Stage stage, Clock::time_point started) {
+      if (enabled() && stage != memstats::Other)
+        _stage_seconds[stage].Observe(started);
+    }
+
+    StageScope::StageScope(memstats::Stage stage): _memory(stage), _stage(stage) {
+      if (enabled())
+        _started = Clock::now();
+    }
+
+    void StageScope::Switch(memstats::Stage stage) {
+      _memory.Switch(stage);
+      if (enabled()) {
+        ObserveStage(_stage, _started);
+        _started = Clock::now();
+      }
+      _stage = stage;
+    }
+
+    StageScope::~StageScope() {
+      ObserveStage(_stage, _started);
+    }
+
+    std::string Format() {
+      std::ostringstream out;
+      unsigned long long finished = 0;
+
+      Header(out, "fpcard_slicer_cards_total", "counter", "Cards finished, by result.");
+      for (int result = 0; result < RESULT_COUNT; ++result) {
+        unsigned long long cards = _cards[result].load(std::memory_order_relaxed);
+        finished += cards;
+        out << "fpcard_slicer_cards_total{result=\"" << RESULT_NAMES[result] << "\"} " << cards << "\n";
+      }
+
+      double elapsed = std::chrono::duration<double>(Clock::now() - _start).count();
+      Header(out, "fpcard_slicer_cards_per_second", "gauge", "Cards finished per second since the start of the run.");
+      out << "fpcard_slicer_cards_per_second " << (elapsed > 0 ? finished / elapsed : 0) << "\n";
+      Header(out, "fpcard_slicer_start_time_seconds", "gauge", "Start of the run in seconds since the epoch.");
+      out << "fpcard_slicer_start_time_seconds " << (long long) _start_time << "\n";
+
+      Header(out, "fpcard_slicer_cards_queued", "gauge", "Sources read and waiting for a worker.");
+      out << "fpcard_slicer_cards_queued " << _queued.load(std::memory_order_relaxed) << "\n";
+      Header(out, "fpcard_slicer_cards_running", "gauge", "Cards being sliced.");
+      out << "fpcard_slicer_cards_running " << _running.load(std::memory_order_relaxed) << "\n";
+
+      Header(out, "fpcard_slicer_read_bytes_total", "counter", "Bytes of the sources sliced.");
+      out << "fpcard_slicer_read_bytes_total " << _read.load(std::memory_order_relaxed) << "\n";
+      Header(out, "fpcard_slicer_written_bytes_total", "counter", "Bytes of the fingerprints saved.");
+      out << "fpcard_slicer_written_bytes_total " << _written.load(std::memory_order_relaxed) << "\n";
+
+      Header(out, "fpcard_slicer_card_seconds", "histogram", "Time to slice a card, skipped cards are not counted.");
+      Write(out, "fpcard_slicer_card_seconds", "", _card_seconds);
+
+      Header(out, "fpcard_slicer_stage_seconds", "histogram", "Time of every run of a pipeline stage.");
+      for (int stage = memstats::Other + 1; stage < memstats::STAGE_COUNT; ++stage)
+        Write(out, "fpcard_slicer_stage_seconds", "stage=\"" + std::string(memstats::name((memstats::Stage) stage)) +
+                                                  "\",", _stage_seconds[stage]);
+
+      return out.str();
+    }
+  }
+}
@@ -1,10 +1,16 @@
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <sstream>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <memory>
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <thread>
 #include "parse_arguments.h"
+#include "layout.h"
 namespace fpcard_slicer {
   namespace application {
     struct stat info;
@@ -14,26 +20,100 @@ namespace fpcard_slicer {
       std::cerr << "Usage: " << name << " <option(s)> SOURCES"
                 << "Options:\n"
                 << "\t-h,--help\tShow this help message\n"
-                << "\t-s,--source SOURCE\tSpecify the image source with 500dpi. Can be source file or directory path\n"
+                << "\t-s,--source SOURCE\tSpecify the image source. Can be source file or directory path\n"
+                << "\t-R,--recursive\tSearch the source directory and its subdirectories\n"
+                << "\t--from-list FILE\tRead the sources from FILE, one path per line. Use - for stdin\n"
                 << "\t-d,--destination DESTINATION\tSpecify the destination path\n"
-                << "\t-f,--format OUTPUT_FORMAT\tSpecify output format (png or jpeg)\n"
+                << "\t-f,--format OUTPUT_FORMAT\tSpecify output format (png, jpg or wsq)\n"
                 << "\t-q,--quality OUTPUT_QUALITY\tSpecify the output quality (only for jpg output format)\n"
+                << "\t-b,--bitrate OUTPUT_BITRATE\tSpecify the output bitrate (only for wsq output format, 0.75 by default)\n"
+                << "\t--png-level LEVEL\tSpecify the png compression level, 0 to 9 (6 by default)\n"
+                << "\t--png-filter FILTER\tSpecify the png row filter: none, sub, up, average, paeth or adaptive (default)\n"
+                << "\t--png-encoder ENCODER\tSpecify the png encoder: libpng (default) or lodepng\n"
+                << "\t--png-fastest\tFastest png output, same as --png-level 1 --png-filter up\n"
+                << "\t--rendition NAME:SCALE:FORMAT[:QUALITY]\tAlso save every fingerprint as fp_N_NAME.FORMAT, reduced by SCALE (0.5) or to a resolution (250ppi). Can be repeated\n"
                 << "\t-o,--demo DEMO_MODE\tSet demo mode. If set, partial output result\n"
+                << "\t-r,--resolution PPI\tSpecify the scan resolution, overrides the resolution of the image file\n"
+                << "\t-j,--threads THREADS\tSpecify the number of threads used by each image filter\n"
+                << "\t-c,--cards CARDS\tSpecify the number of cards processed at the same time (1 by default, one per core with --memory-limit)\n"
+                << "\t--memory-limit SIZE\tStart a card only while the estimated memory of the running cards fits in SIZE (bytes, or with K, M or G)\n"
+                << "\t--shard I/N\tProcess only the sources of shard I of N, by a hash of their relative path, with a manifest of its own\n"
+                << "\t--memstats\tPrint the allocations and the peak of live memory of every stage, per card and per batch (MEMSTATS build)\n"
+                << "\t--metrics FILE\tKeep the progress, throughput and stage latencies of the run in FILE, in Prometheus text format\n"
+                << "\t--no-triage\tSlice every source, without checking first that it looks like a card\n"
+                << "\t--no-deskew\tTake the crops straight, without measuring how much the card is turned\n"
+                << "\t-t,--threshold METHOD\tSpecify how the binarization threshold is taken: mean (default) or otsu, for faded cards\n"
+                << "\t-e,--engine ENGINE\tSpecify how the fingerprints are found: filters (default) or components, for cards whose rows are not at the halves\n"
+                << "\t-l,--layout LAYOUT\tSearch the fingerprints only in the boxes of LAYOUT, a card layout of the layout file\n"
+                << "\t--layout-file FILE\tSpecify the layout file (slicer.ini of the working directory by default)\n"
+                << "\t-F,--force\tProcess every source again, even if the destination manifest has it\n"
                 << std::endl;
     }
 
-    std::vector<std::string> GetSources(std::string source) {
-      std::vector<std::string> file_list;
-      std::shared_ptr<DIR> directory_ptr(opendir(source.c_str()), [](DIR* dir){ dir && closedir(dir); });
-      struct dirent *dirent_ptr;
-      while ((dirent_ptr = readdir(directory_ptr.get())) != nullptr) {
-        std::string name(dirent_ptr->d_name);
+    namespace {
+      // The whole text as a number, atoi and atof take "8x" as 8 and "x" as 0
+      bool ParseInt(const std::string &text, int &value) {
+        char *end;
+        long parsed = strtol(text.c_str(), &end, 10);
+        if (text.empty() || isspace((unsigned char) text[0]) || *end != '\0' || parsed < INT_MIN || parsed > INT_MAX)
+          return false;
+        value = (int) parsed;
+        return true;
+      }
+
+      bool ParseFloat(const std::string &text, float &value) {
+        char *end;
+        value = strtof(text.c_str(), &end);
+        return !text.empty() && !isspace((unsigned char) text[0]) && *end == '\0' && std::isfinite(value);
+      }
+    }
+
+    // NAME:SCALE:FORMAT[:QUALITY], SCALE as 0.25 or 250ppi, QUALITY as in -q, -b or --png-level
+    bool ParseRendition(const std::string& value, const image::SaveOptions& defaults, Rendition& rendition) {
+      std::vector<std::string> fields;
+      std::stringstream stream(value);
+      std::string field;
+
+      while (std::getline(stream, field, ':'))
+        fields.push_back(field);
+
+      if (fields.size() < 3 || fields.size() > 4 || fields[0].empty() ||
+          fields[0].find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-") != std::string::npos)
+        return false;
+
+      rendition.name = fields[0];
+      const std::string &scale = fields[1];
+      if (scale.size() > 3 && scale.compare(scale.size() - 3, 3, "ppi") == 0) {
+        int ppi;
+        if (!ParseInt(scale.substr(0, scale.size() - 3), ppi) || ppi <= 0)
+          return false;
+        rendition.ppi = (unsigned) ppi;
+      } else {
+        if (!ParseFloat(scale, rendition.scale) || rendition.scale <= 0 || rendition.scale > 1)
+          return false;
+      }
+
+      rendition.format = fields[2];
+      if (rendition.format != "jpg" && rendition.format != "png" && rendition.format != "wsq")
+        return false;
+#ifndef HAVE_NBIS
+      if (rendition.format == "wsq")
+        return false;
+#endif
 
-        if(name.rfind(".jpg") != std::string::npos || name.rfind(".png") != std::string::npos)
-          file_list.push_back(source + "/" + name);
+      rendition.save_options = defaults;
+      if (fields.size() == 4) {
+        auto &options = rendition.save_options;
+        if (rendition.format == "jpg")
+          return ParseInt(fields[3], options.quality) && options.quality >= MINIMUM_QUALITY &&
+                 options.quality <= MAXIMUM_QUALITY;
+        else if (rendition.format == "wsq")
+          return ParseFloat(fields[3], options.bitrate) && options.bitrate > 0;
+        else
+          return ParseInt(fields[3], options.png_level) && options.png_level >= 0 && options.png_level <= 9;
       }
 
-      return file_list;
+      return true;
     }
 
     bool ParseArguments(int argc, char** argv, SlicerConfig& config) {
@@ -42,10 +122,13 @@ namespace fpcard_slicer {
         return false;
       }
 
-      std::vector <std::string> sources;
-      int quality = 80;
-      bool demo = false;
-      std::string source, destination, format = "jpg";
+      image::SaveOptions save_options;
+      save_options.quality = 80;
+      unsigned resolution = 0, threads = 1, cards = 0, shard = 1, shard_count = 1;
+      unsigned long long memory_limit = 0;
+      std::vector<std::string> rendition_values;
+      bool demo = false, force = false, recursive = false, triage = true, memstats = false, deskew = true;
+      std::string source, source_list_file, destination, format = "jpg", layout, layout_file, binarization, engine, metrics_file;
       for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if ((arg == "-h") || (arg == "--help")) {
@@ -60,6 +143,17 @@ namespace fpcard_slicer {
             return false;
           }
         }
+        else if ((arg == "-R") || (arg == "--recursive")) {
+          recursive = true;
+        }
+        else if (arg == "--from-list") {
+          if (i + 1 < argc) {
+            source_list_file = argv[++i];
+          } else {
+            std::cerr << "--from-list option requires one argument." << std::endl;
+            return false;
+          }
+        }
         else if ((arg == "-d") || (arg == "--destination")) {
           if (i + 1 < argc) {
             destination = argv[++i];
@@ -71,10 +165,16 @@ namespace fpcard_slicer {
         else if ((arg == "-f") || (arg == "--format")) {
           if (i + 1 < argc) {
             format = argv[++i];
-            if(format != "jpg" && format != "png") {
+            if(format != "jpg" && format != "png" && format != "wsq") {
               std::cerr << "--format " << format <<  " not support." << std::endl;
               return false;
             }
+#ifndef HAVE_NBIS
+            if(format == "wsq") {
+              std::cerr << "--format wsq not support, built without NBIS." << std::endl;
+              return false;
+            }
+#endif
           } else {
             std::cerr << "--format option requires one argument." << std::endl;
             return false;
@@ -82,19 +182,230 @@ namespace fpcard_slicer {
         }
         else if ((arg == "-q") || (arg == "--quality")) {
           if (i + 1 < argc) {
-            quality = atoi(argv[++i]);
+            if (!ParseInt(argv[++i], save_options.quality) || save_options.quality < MINIMUM_QUALITY ||
+                save_options.quality > MAXIMUM_QUALITY) {
+              std::cerr << "--quality must be between " << MINIMUM_QUALITY << " and " << MAXIMUM_QUALITY << "."
+                        << std::endl;
+              return false;
+            }
           } else {
             std::cerr << "--quality option requires one argument." << std::endl;
             return false;
           }
         }
+        else if ((arg == "-b") || (arg == "--bitrate")) {
+          if (i + 1 < argc) {
+            if(!ParseFloat(argv[++i], save_options.bitrate) || save_options.bitrate <= 0) {
+              std::cerr << "--bitrate must be greater than 0." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--bitrate option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--png-level") {
+          if (i + 1 < argc) {
+            if(!ParseInt(argv[++i], save_options.png_level) || save_options.png_level < 0 ||
+               save_options.png_level > 9) {
+              std::cerr << "--png-level must be between 0 and 9." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--png-level option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--png-filter") {
+          if (i + 1 < argc) {
+            const std::vector<std::string> filters = {"none", "sub", "up", "average", "paeth", "adaptive"};
+            std::string filter = argv[++i];
+            auto it = std::find(filters.begin(), filters.end(), filter);
+            if(it == filters.end()) {
+              std::cerr << "--png-filter " << filter << " not support." << std::endl;
+              return false;
+            }
+            save_options.png_filter = (image::PngFilter) (it - filters.begin());
+          } else {
+            std::cerr << "--png-filter option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--png-encoder") {
+          if (i + 1 < argc) {
+            std::string encoder = argv[++i];
+            if(encoder == "libpng") {
+              save_options.png_encoder = image::LibPng;
+            } else if(encoder == "lodepng") {
+              save_options.png_encoder = image::LodePng;
+            } else {
+              std::cerr << "--png-encoder " << encoder << " not support." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--png-encoder option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--png-fastest") {
+          save_options.png_level = 1;
+          save_options.png_filter = image::FilterUp;
+        }
+        else if (arg == "--rendition") {
+          if (i + 1 < argc) {
+            rendition_values.push_back(argv[++i]);
+          } else {
+            std::cerr << "--rendition option requires one argument." << std::endl;
+            return false;
+          }
+        }
         else if ((arg == "-o") || (arg == "--demo")) {
           demo = true;
         }
+        else if ((arg == "-F") || (arg == "--force")) {
+          force = true;
+        }
+        else if ((arg == "-r") || (arg == "--resolution")) {
+          if (i + 1 < argc) {
+            char *end;
+            const char *value = argv[++i];
+            unsigned long parsed = isdigit((unsigned char) *value) ? strtoul(value, &end, 10) : 0;
+            if (parsed < MINIMUM_RESOLUTION || parsed > MAXIMUM_RESOLUTION || *end != '\0') {
+              std::cerr << "--resolution " << value << " is invalid, a ppi from " << MINIMUM_RESOLUTION << " to "
+                        << MAXIMUM_RESOLUTION << " expected." << std::endl;
+              return false;
+            }
+            resolution = (unsigned) parsed;
+          } else {
+            std::cerr << "--resolution option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if ((arg == "-c") || (arg == "--cards")) {
+          if (i + 1 < argc) {
+            cards = (unsigned) atoi(argv[++i]);
+            if(cards == 0) {
+              std::cerr << "--cards must be greater than 0." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--cards option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--memory-limit") {
+          if (i + 1 < argc) {
+            char *unit;
+            memory_limit = strtoull(argv[++i], &unit, 10);
+            std::string suffix = unit;
+            if(suffix == "K" || suffix == "k")
+              memory_limit <<= 10;
+            else if(suffix == "M" || suffix == "m")
+              memory_limit <<= 20;
+            else if(suffix == "G" || suffix == "g")
+              memory_limit <<= 30;
+            else if(!suffix.empty())
+              memory_limit = 0;
+            if(memory_limit == 0) {
+              std::cerr << "--memory-limit " << argv[i] << " is invalid." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--memory-limit option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--shard") {
+          if (i + 1 < argc) {
+            char *slash, *end = nullptr;
+            shard = strtoul(argv[++i], &slash, 10);
+            shard_count = (*slash == '/') ? strtoul(slash + 1, &end, 10) : 0;
+            if(shard_count == 0 || *end != '\0' || shard == 0 || shard > shard_count) {
+              std::cerr << "--shard " << argv[i] << " is invalid, I/N with I from 1 to N expected." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--shard option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--memstats") {
+#ifndef HAVE_MEMSTATS
+          std::cerr << "--memstats not support, built without -DMEMSTATS=ON." << std::endl;
+          return false;
+#endif
+          memstats = true;
+        }
+        else if (arg == "--metrics") {
+          if (i + 1 < argc) {
+            metrics_file = argv[++i];
+          } else {
+            std::cerr << "--metrics option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--no-triage") {
+          triage = false;
+        }
+        else if (arg == "--no-deskew") {
+          deskew = false;
+        }
+        else if ((arg == "-t") || (arg == "--threshold")) {
+          if (i + 1 < argc) {
+            binarization = argv[++i];
+            if(binarization != "mean" && binarization != "otsu") {
+              std::cerr << "--threshold " << binarization << " not support." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--threshold option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if ((arg == "-e") || (arg == "--engine")) {
+          if (i + 1 < argc) {
+            engine = argv[++i];
+            if(engine != "filters" && engine != "components") {
+              std::cerr << "--engine " << engine << " not support." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--engine option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if ((arg == "-l") || (arg == "--layout")) {
+          if (i + 1 < argc) {
+            layout = argv[++i];
+          } else {
+            std::cerr << "--layout option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if (arg == "--layout-file") {
+          if (i + 1 < argc) {
+            layout_file = argv[++i];
+          } else {
+            std::cerr << "--layout-file option requires one argument." << std::endl;
+            return false;
+          }
+        }
+        else if ((arg == "-j") || (arg == "--threads")) {
+          if (i + 1 < argc) {
+            threads = (unsigned) atoi(argv[++i]);
+            if(threads == 0) {
+              std::cerr << "--threads must be greater than 0." << std::endl;
+              return false;
+            }
+          } else {
+            std::cerr << "--threads option requires one argument." << std::endl;
+            return false;
+          }
+        }
       }
 
-      if(source.empty()) {
-        std::cerr << "--source is required." << std::endl;
+      if(source.empty() && source_list_file.empty()) {
+        std::cerr << "--source or --from-list is required." << std::endl;
         return false;
       }
       if(destination.empty()) {
@@ -102,28 +413,18 @@ namespace fpcard_slicer {
         return false;
       }
 
-      std::vector<std::string> source_list;
-
-      if( stat(source.c_str(),&info) == 0 ) {
-        if( info.st_mode & S_IFDIR ) {
-          source_list = GetSources(source);
-
-          if(source_list.empty()) {
-            std::cerr << "--source is empty if png or jpg images" << std::endl;
-            return false;
-          }
-        }
-        else if( info.st_mode & S_IFREG ) {
-          source_list.push_back(source);
-        }
-        else {
+      if(!source.empty()) {
+        if( stat(source.c_str(),&info) != 0 || !(S_ISDIR(info.st_mode) || S_ISREG(info.st_mode)) ) {
           std::cerr << "--source is invalid." << std::endl;
           return false;
         }
       }
-      else {
-        std::cerr << "--source is invalid." << std::endl;
-        return false;
+
+      if(!source_list_file.empty() && source_list_file != "-") {
+        if( stat(source_list_file.c_str(),&info) != 0 || !S_ISREG(info.st_mode) ) {
+          std::cerr << "--from-list is invalid." << std::endl;
+          return false;
+        }
       }
 
       if( stat(destination.c_str(), &info ) != 0 || info.st_mode & S_IFREG) {
@@ -131,11 +432,61 @@ namespace fpcard_slicer {
         return false;
       }
 
-      config.set_source_list(source_list);
+      if(!layout_file.empty()) {
+        if( stat(layout_file.c_str(),&info) != 0 || !S_ISREG(info.st_mode) ) {
+          std::cerr << "--layout-file is invalid." << std::endl;
+          return false;
+        }
+      }
+      else if( stat(slicer::LAYOUT_FILE_NAME.c_str(),&info) == 0 && S_ISREG(info.st_mode) ) {
+        layout_file = slicer::LAYOUT_FILE_NAME;
+      }
+      else if(!layout.empty()) {
+        std::cerr << "--layout requires a layout file." << std::endl;
+        return false;
+      }
+
+      // Renditions start from the options of the main output, whatever order they were given in
+      std::vector<Rendition> renditions;
+      for(auto &value : rendition_values) {
+        Rendition rendition;
+        if(!ParseRendition(value, save_options, rendition)) {
+          std::cerr << "--rendition " << value << " is invalid." << std::endl;
+          return false;
+        }
+        for(auto &other : renditions) {
+          if(other.name == rendition.name) {
+            std::cerr << "--rendition " << rendition.name << " is repeated." << std::endl;
+            return false;
+          }
+        }
+        renditions.push_back(rendition);
+      }
+
+      config.set_source(source);
+      config.set_source_list_file(source_list_file);
+      config.set_recursive(recursive);
       config.set_destination(destination);
       config.set_output_format(format);
-      config.set_output_quality(quality);
+      config.set_save_options(save_options);
+      config.set_renditions(renditions);
       config.set_demo_mode(demo);
+      config.set_resolution(resolution);
+      config.set_threads(threads);
+      config.set_force(force);
+      config.set_triage(triage);
+      config.set_deskew(deskew);
+      config.set_memstats(memstats);
+      config.set_shard(shard, shard_count);
+      config.set_metrics_file(metrics_file);
+      if(cards == 0)
+        cards = memory_limit ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+      config.set_cards(cards);
+      config.set_memory_limit(memory_limit);
+      config.set_layout_file(layout_file);
+      config.set_layout(layout);
+      config.set_binarization(binarization);
+      config.set_engine(engine);
 
       return true;
     }
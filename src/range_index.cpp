@@ -0,0 +1,86 @@
+#include "range_index.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    static inline unsigned Log2(unsigned value) {
+      unsigned log = 0;
+      while (value >>= 1)
+        ++log;
+      return log;
+    }
+
+    RangeIndex::RangeIndex(const std::vector<int> &values): _values(values) {
+      unsigned n = size();
+      if (n == 0)
+        return;
+
+      unsigned levels = Log2(n) + 1;
+      _max.resize(levels);
+      _min.resize(levels);
+
+      _max[0].resize(n);
+      for (unsigned i = 0; i < n; ++i)
+        _max[0][i] = i;
+      _min[0] = _max[0];
+
+      for (unsigned j = 1; j < levels; ++j) {
+        unsigned half = 1u << (j - 1);
+        unsigned count = n - (1u << j) + 1;
+        _max[j].resize(count);
+        _min[j].resize(count);
+        for (unsigned i = 0; i < count; ++i) {
+          _max[j][i] = Pick(_max[j - 1][i], _max[j - 1][i + half], true);
+          _min[j][i] = Pick(_min[j - 1][i], _min[j - 1][i + half], false);
+        }
+      }
+    }
+
+    unsigned RangeIndex::Best(const std::vector<std::vector<unsigned>> &table, unsigned begin, unsigned end,
+                              bool greater) const {
+      unsigned j = Log2(end - begin);
+      return Pick(table[j][begin], table[j][end - (1u << j)], greater);
+    }
+
+    unsigned RangeIndex::ArgMax(unsigned begin, unsigned end) const {
+      return Best(_max, begin, end, true);
+    }
+
+    unsigned RangeIndex::ArgMin(unsigned begin, unsigned end) const {
+      return Best(_min, begin, end, false);
+    }
+
+    // Skips the blocks of 2^j that have no match, from the largest block down
+    unsigned RangeIndex::FirstAbove(unsigned begin, int limit) const {
+      unsigned position = begin;
+
+      for (int j = (int) _max.size() - 1; j >= 0 && position < size(); --j) {
+        if (position + (1u << j) <= size() && _values[_max[j][position]] <= limit)
+          position += 1u << j;
+      }
+
+      return position < size() ? position : size();
+    }
+
+    unsigned RangeIndex::FirstBelow(unsigned begin, int limit) const {
+      unsigned position = begin;
+
+      for (int j = (int) _min.size() - 1; j >= 0 && position < size(); --j) {
+        if (position + (1u << j) <= size() && _values[_min[j][position]] >= limit)
+          position += 1u << j;
+      }
+
+      return position < size() ? position : size();
+    }
+
+    int RangeIndex::LastBelow(unsigned begin, unsigned end, int limit) const {
+      unsigned position = end;
+
+      for (int j = (int) _min.size() - 1; j >= 0 && position > begin; --j) {
+        if (position >= begin + (1u << j) && _values[_min[j][position - (1u << j)]] >= limit)
+          position -= 1u << j;
+      }
+
+      return position > begin ? (int) position - 1 : -1;
+    }
+  }
+}
@@ -0,0 +1,97 @@
+#include "scheduler.h"
+
+namespace fpcard_slicer {
+  namespace application {
+    unsigned long long EstimateFootprint(image::Format format, const image::Header &header, unsigned factor) {
+      unsigned long long pixels = (unsigned long long) header.size.width * header.size.height;
+      float footprint = (format == image::Format::PNG) ? PNG_FOOTPRINT : JPEG_FOOTPRINT;
+
+      return (unsigned long long) (pixels * footprint + pixels * THUMBNAIL_FOOTPRINT / (factor * factor)) +
+             CARD_OVERHEAD;
+    }
+
+    CardScheduler::CardScheduler(unsigned workers, unsigned long long memory_limit): _memory_limit(memory_limit) {
+      if (workers == 0)
+        workers = 1;
+
+      for (unsigned worker = 0; worker < workers; ++worker)
+        _workers.emplace_back(&CardScheduler::Loop, this);
+    }
+
+    CardScheduler::~CardScheduler() {
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+      }
+      _changed.notify_all();
+
+      for (auto &worker : _workers)
+        worker.join();
+    }
+
+    void CardScheduler::Submit(unsigned long long footprint, const Job &job) {
+      std::unique_lock<std::mutex> lock(_lock);
+      // Enough cards ahead to pick the ones that fit, without reading the whole source
+      _changed.wait(lock, [this] { return _pending.size() < _workers.size() * 2; });
+      _pending.push_back(Pending{footprint, job, 0});
+      lock.unlock();
+      _changed.notify_all();
+    }
+
+    void CardScheduler::Wait() {
+      std::unique_lock<std::mutex> lock(_lock);
+      _changed.wait(lock, [this] { return _pending.empty() && _running == 0; });
+
+      if (_error) {
+        std::exception_ptr error = _error;
+        _error = nullptr;
+        std::rethrow_exception(error);
+      }
+    }
+
+    size_t CardScheduler::Admissible() {
+      for (size_t index = 0; index < _pending.size(); ++index) {
+        if (_running == 0 || _memory_limit == 0 || _in_use + _pending[index].footprint <= _memory_limit)
+          return index;
+        // The first card waits for room once it has been passed enough times
+        if (_pending.front().passed >= _workers.size())
+          break;
+      }
+
+      return _pending.size();
+    }
+
+    void CardScheduler::Loop() {
+      std::unique_lock<std::mutex> lock(_lock);
+
+      for (;;) {
+        size_t index;
+        _changed.wait(lock, [&] { return _stop || (index = Admissible()) < _pending.size(); });
+        if (_stop)
+          return;
+
+        Pending pending = _pending[index];
+        _pending.erase(_pending.begin() + index);
+        if (index > 0)
+          ++_pending.front().passed;
+        _in_use += pending.footprint;
+        ++_running;
+        lock.unlock();
+        _changed.notify_all();
+
+        try {
+          pending.job();
+        } catch (...) {
+          std::lock_guard<std::mutex> guard(_lock);
+          if (!_error)
+            _error = std::current_exception();
+        }
+
+        lock.lock();
+        _in_use -= pending.footprint;
+        --_running;
+        _changed.notify_all();
+      }
+    }
+  }
+}
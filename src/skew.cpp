@@ -0,0 +1,66 @@
+#include <math.h>
+#include <vector>
+#include "skew.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    namespace {
+      struct Offset {
+        float x, y;
+      };
+
+      // Sum of the squared row counts of the ink edges seen straightened by degrees. The total is
+      // the same for every angle, so the largest sum is the largest variance.
+      double ProfileScore(const std::vector<Offset> &ink, unsigned rows, float degrees) {
+        float radians = degrees * M_PI / 180, sine = sin(radians), cosine = cos(radians);
+        std::vector<unsigned> profile(rows, 0);
+
+        for (auto &pixel : ink) {
+          int row = (int) floor(cosine * pixel.y - sine * pixel.x + rows / 2);
+          if (row >= 0 && row < (int) rows)
+            ++profile[row];
+        }
+
+        double score = 0;
+        for (auto count : profile)
+          score += (double) count * count;
+        return score;
+      }
+    }
+
+    float EstimateSkew(std::shared_ptr<image::Image> &image) {
+      const float center_x = image->width() / 2.0, center_y = image->height() / 2.0;
+      // Rows of the turned image, room for the corners
+      const unsigned rows = image->width() + image->height();
+      std::vector<Offset> ink;
+
+      auto pixel = image->get();
+      const unsigned width = image->width();
+      for (unsigned y = 1; y < image->height(); ++y)
+        for (unsigned x = 0; x < width; ++x)
+          if (pixel[y * width + x] == image->black() && pixel[(y - 1) * width + x] != image->black())
+            ink.push_back(Offset{x - center_x, y - center_y});
+
+      if (ink.empty())
+        return 0;
+
+      float best = 0;
+      double best_score = ProfileScore(ink, rows, 0);
+      auto search = [&](float first, float last, float step) {
+        for (float degrees = first; degrees <= last + step / 2; degrees += step) {
+          double score = ProfileScore(ink, rows, degrees);
+          if (score > best_score) {
+            best_score = score;
+            best = degrees;
+          }
+        }
+      };
+
+      search(-MAXIMUM_SKEW, MAXIMUM_SKEW, COARSE_SKEW_STEP);
+      float coarse = best;
+      search(coarse - COARSE_SKEW_STEP, coarse + COARSE_SKEW_STEP, FINE_SKEW_STEP);
+
+      return best;
+    }
+  }
+}
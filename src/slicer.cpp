@@ -1,42 +1,155 @@
+#include <math.h>
+#include <sstream>
 #include <slicer.h>
+#include <metrics.h>
 
 namespace fpcard_slicer {
   namespace slicer {
-    const std::vector<image::Clip> Slicer::CalculateSlice(std::shared_ptr<image::Image> &image,
-                                                          const std::string& partial_out) {
-      auto scaled_image = image->Scale(1.0 / Z_FAC);
-      scaled_image->ApplyBinarizedFilter(_bin_umbral);
+    namespace {
+      inline unsigned Center(unsigned first, unsigned last) {
+        return (first + last) / 2;
+      }
 
-      auto clip_edges = SearchEdges(scaled_image, 0.8, 10);
-      auto clip_image = scaled_image->Cut(clip_edges);
+      // Ink inside clip, with the box shrunk to it
+      Component Measure(std::shared_ptr<image::Image> &ink, image::Clip clip) {
+        Component blob;
+        unsigned left = clip.right(), right = clip.left(), top = clip.bottom(), bottom = clip.top();
+
+        for (unsigned y = clip.top(); y < clip.bottom(); ++y) {
+          for (unsigned x = clip.left(); x < clip.right(); ++x) {
+            if (ink->pixel(x, y) != ink->black())
+              continue;
+            ++blob.pixels;
+            left = std::min(left, x);
+            right = std::max(right, x + 1);
+            top = std::min(top, y);
+            bottom = std::max(bottom, y + 1);
+          }
+        }
+
+        if (blob.pixels)
+          blob.box = image::Clip(left, right, top, bottom);
+        return blob;
+      }
+
+      // Clip of a straightened image of the given size in the image before it was turned by degrees
+      image::Clip Turn(image::Clip clip, float degrees, image::Size size) {
+        float radians = degrees * M_PI / 180, sine = sin(radians), cosine = cos(radians);
+        float dx = (clip.left() + clip.right()) / 2.0 - size.width / 2.0;
+        float dy = (clip.top() + clip.bottom()) / 2.0 - size.height / 2.0;
+        float center_x = size.width / 2.0 + cosine * dx - sine * dy;
+        float center_y = size.height / 2.0 + sine * dx + cosine * dy;
+        float half_width = clip.width() / 2.0, half_height = clip.height() / 2.0;
+
+        image::Clip turned((unsigned) std::max(0.0f, roundf(center_x - half_width)), (unsigned) roundf(center_x + half_width),
+                           (unsigned) std::max(0.0f, roundf(center_y - half_height)), (unsigned) roundf(center_y + half_height));
+        turned.set_angle(degrees);
+        return turned;
+      }
+
+      // Two fingers that touch in the scan, cut at the column with least ink of the middle half
+      // (the rounded sides of a fingerprint have less ink than the join)
+      void Split(std::shared_ptr<image::Image> &ink, std::vector<Component> &row, unsigned index) {
+        auto box = row[index].box;
+        unsigned begin = box.left() + box.width() / 4, end = box.right() - box.width() / 4;
+        unsigned cut = begin, least = box.height() + 1;
+
+        for (unsigned x = begin; x < end; ++x) {
+          unsigned sum = 0;
+          for (unsigned y = box.top(); y < box.bottom(); ++y)
+            sum += ink->pixel(x, y) == ink->black();
+          if (sum < least) {
+            least = sum;
+            cut = x;
+          }
+        }
+
+        row[index] = Measure(ink, image::Clip(box.left(), cut, box.top(), box.bottom()));
+        row.insert(row.begin() + index + 1, Measure(ink, image::Clip(cut, box.right(), box.top(), box.bottom())));
+      }
+    }
 
-      image::Clip clip_top(0, clip_image->width(), 0, clip_image->height() / 2);
-      image::Clip clip_bottom(0, clip_image->width(), clip_image->height() / 2, clip_image->height());
+    const std::vector<image::Clip> Slicer::CalculateSlice(std::shared_ptr<image::Image> &image, unsigned ppi,
+                                                          const std::string& partial_out) {
+      unsigned factor = ScaleFactor(ppi);
+      std::shared_ptr<image::Image> scaled_image;
+      image::Histogram histogram;
+      {
+        metrics::StageScope stage(memstats::Scale);
+        scaled_image = image->Scale(1.0 / factor, &histogram);
+      }
+      return CalculateScaledSlice(scaled_image, factor, histogram, partial_out);
+    }
+
+    const std::vector<image::Clip> Slicer::CalculateScaledSlice(std::shared_ptr<image::Image> &scaled_image,
+                                                                unsigned factor, const std::string& partial_out) {
+      return CalculateScaledSlice(scaled_image, factor, scaled_image->histogram(), partial_out);
+    }
 
-      auto image_top = clip_image->Cut(clip_top);
-      auto image_bottom = clip_image->Cut(clip_bottom);
+    const std::vector<image::Clip> Slicer::CalculateScaledSlice(std::shared_ptr<image::Image> &scaled_image,
+                                                                unsigned factor, const image::Histogram& histogram,
+                                                                const std::string& partial_out) {
+      metrics::StageScope stage(memstats::Binarize);
+      if (_binarization == image::Otsu)
+        scaled_image->ApplyThreshold(image::Image::OtsuThreshold(histogram));
+      else
+        scaled_image->ApplyThreshold(image::Image::MeanThreshold(histogram, _bin_umbral));
 
-      ApplyFilters(image_top);
-      ApplyFilters(image_bottom);
+      stage.Switch(memstats::Edges);
+      auto clip_edges = SearchEdges(scaled_image, 0.8, 10);
+      auto clip_image = scaled_image->Cut(clip_edges);
 
-      auto clip_top_list = SearchFingerprints(image_top);
-      auto clip_bottom_list = SearchFingerprints(image_bottom);
+      // Only the thumbnail is straightened, the crops are resampled along the turned clips
+      float skew = 0;
+      if (_deskew) {
+        stage.Switch(memstats::Deskew);
+        skew = EstimateSkew(clip_image);
+        if (fabs(skew) >= MINIMUM_SKEW)
+          clip_image = clip_image->Rotate(skew);
+        else
+          skew = 0;
+      }
 
       std::vector<image::Clip> result;
-      for (auto &clip:clip_top_list) {
-        clip.Scale(Z_FAC);
-        result.push_back(clip);
+      std::vector<std::shared_ptr<image::Image>> regions;
+
+      if (_engine == Components) {
+        stage.Switch(memstats::Search);
+        auto ink = clip_image->Cut(image::Clip(0, clip_image->width(), 0, clip_image->height()));
+        result = SearchComponents(ink);
+        regions.push_back(ink);
+      }
+      else if (_mode == Sector) {
+        result = SearchLayout(clip_image, regions);
       }
+      else {
+        image::Clip clip_top(0, clip_image->width(), 0, clip_image->height() / 2);
+        image::Clip clip_bottom(0, clip_image->width(), clip_image->height() / 2, clip_image->height());
+
+        stage.Switch(memstats::Filters);
+        auto image_top = clip_image->Cut(clip_top);
+        auto image_bottom = clip_image->Cut(clip_bottom);
+
+        ApplyFilters(image_top);
+        ApplyFilters(image_bottom);
+
+        stage.Switch(memstats::Search);
+        result = SearchFingerprints(image_top, _fp_number / 2);
+        for (auto &clip:SearchFingerprints(image_bottom, _fp_number / 2)) {
+          clip.Expand(0, image_top->height());
+          result.push_back(clip);
+        }
 
-      for (auto &clip:clip_bottom_list) {
-        clip.Expand(0, image_top->height());
-        clip.Scale(Z_FAC);
-        result.push_back(clip);
+        regions.push_back(image_top);
+        regions.push_back(image_bottom);
       }
 
-      clip_edges.Scale(Z_FAC);
+      clip_edges.Scale(factor);
 
       for (auto &clip:result) {
+        if (skew != 0 && clip.length() > 0)
+          clip = Turn(clip, skew, clip_image->size());
+        clip.Scale(factor);
         clip.set_left(clip.left() + clip_edges.left());
         clip.set_right(clip.right() + clip_edges.left());
         clip.set_top(clip.top() + clip_edges.top());
@@ -44,15 +157,49 @@ namespace fpcard_slicer {
       }
 
       if(partial_out.length()>0) {
+        stage.Switch(memstats::Encode);
         scaled_image->Save(partial_out + "/01_binarized.jpg", 80);
         clip_image->Save(partial_out   + "/02_clip.jpg", 80);
-        image_top->Save(partial_out    + "/03_top.jpg", 80);
-        image_bottom->Save(partial_out + "/04_bottom.jpg", 80);
+        if (_engine == Components) {
+          regions[0]->Save(partial_out + "/03_components.jpg", 80);
+        }
+        else if (_mode == Sector) {
+          for (unsigned index = 0; index < regions.size(); ++index)
+            regions[index]->Save(partial_out + "/03_box_" + std::to_string(index) + ".jpg", 80);
+        }
+        else {
+          regions[0]->Save(partial_out + "/03_top.jpg", 80);
+          regions[1]->Save(partial_out + "/04_bottom.jpg", 80);
+        }
       }
 
       return result;
     }
 
+    std::string Slicer::Signature() const {
+      std::ostringstream out;
+
+      out << "mode " << _mode << " fp " << _fp_number << " umbral " << _bin_umbral << " binarization "
+          << _binarization << " engine " << _engine << " deskew " << _deskew << " filters";
+      for (auto &step : _filters)
+        out << " " << step.kind << ":" << step.width << "x" << step.height;
+      if (_mode == Sector) {
+        out << " margin " << _layout.margin << " boxes";
+        for (auto &box : _layout.boxes)
+          out << " " << box.left << "," << box.right << "," << box.top << "," << box.bottom;
+      }
+
+      return out.str();
+    }
+
+    unsigned EffectivePpi(unsigned file_ppi) {
+      return file_ppi < MINIMUM_PPI ? REFERENCE_PPI : file_ppi;
+    }
+
+    unsigned Slicer::ScaleFactor(unsigned ppi) {
+      return std::max(1u, (unsigned) round(ppi * Z_FAC / REFERENCE_PPI));
+    }
+
     image::Clip Slicer::SearchEdges(std::shared_ptr<image::Image> &image, int umbral, int padding) {
       image::Clip clip;
 
@@ -172,99 +319,91 @@ namespace fpcard_slicer {
     }
 
     void Slicer::ApplyFilters(std::shared_ptr<image::Image> &image) {
-      image->ApplyAverageFilter(5, 5);
-      image->ApplyAverageFilter(5, 9);
-      image->ApplyVerticalFilter(3, 7);
-      image->ApplyVerticalFilter(7, 7);
-      image->ApplyHorizontalWhiteFilter(7, 11);
-      image->ApplyVerticalFilter(11, 7);
-      image->ApplyVerticalFilter(15, 7);
+      // Windows from slicer.ini run the kernels with the block given at runtime
+      for (auto &step : _filters) {
+        switch (step.kind) {
+          case FilterStep::Average:
+            image->ApplyAverageFilter(step.width, step.height);
+            break;
+          case FilterStep::Vertical:
+            image->ApplyVerticalFilter(step.width, step.height);
+            break;
+          case FilterStep::HorizontalWhite:
+            image->ApplyHorizontalWhiteFilter(step.width, step.height);
+            break;
+          case FilterStep::HorizontalBlack:
+            image->ApplyHorizontalBlackFilter(step.width, step.height);
+            break;
+          case FilterStep::Edge:
+            image->ApplyEdgeFilter(step.width, image->white());
+            break;
+        }
+      }
+      if (!_filters.empty())
+        return;
+
+      image->ApplyAverageFilter<5, 5>();
+      image->ApplyAverageFilter<5, 9>();
+      image->ApplyVerticalFilter<3, 7>();
+      image->ApplyVerticalFilter<7, 7>();
+      image->ApplyHorizontalWhiteFilter<7, 11>();
+      image->ApplyVerticalFilter<11, 7>();
+      image->ApplyVerticalFilter<15, 7>();
       image->ApplyEdgeFilter(5, image->white());
-      image->ApplyHorizontalBlackFilter(5, 21);
+      image->ApplyHorizontalBlackFilter<5, 21>();
       image->ApplyEdgeFilter(5, image->white());
     }
 
     image::Clip
-    Slicer::SearchFingerprint(std::shared_ptr<image::Image> &image, int last, std::vector<int> vec_sum_black,
-                              std::vector<int> vec_sum_black_max) {
+    Slicer::SearchFingerprint(std::shared_ptr<image::Image> &image, int last, unsigned start,
+                              const RangeIndex &columns, const std::vector<unsigned> &row_black) {
       image::Clip coord;
-      START:
-      // Set h_max
-      int h_max = 0, h_max_val = 0;
-      bool start = false;
-      unsigned end = image->width();
-      for (unsigned k = last; k < end; k++) {
-        if (!start) {
-          if (vec_sum_black_max[k] > 20) {
-            start = true;
-            end = k + MAXIMUM_SIZE_WIDTH;
-            h_max_val = vec_sum_black_max[k];
-            h_max = k;
-          }
-        } else {
-          if (vec_sum_black_max[k] == 0)
-            break;
+      const unsigned width = image->width();
+      int h_max, k;
 
-          if (vec_sum_black_max[k] > h_max_val) {
-            h_max_val = vec_sum_black_max[k];
-            h_max = k;
-          }
-        }
-      }
+      for (;;) {
+        // Set h_max, highest column of the first run over 20 (columns before start are already taken)
+        unsigned begin = std::max((unsigned) last, start);
+        unsigned run_start = begin < width ? columns.FirstAbove(begin, 20) : width;
 
-      if (h_max_val == 0)
-        return coord;
+        if (run_start >= width)
+          return coord;
 
-      // Set left
-      int k;
-      for (k = h_max; k >= last; k--) {
-        if (vec_sum_black[k] < 10) {
-          k--;
-          break;
-        }
-      }
-      coord.set_left(k);
+        unsigned run_end = std::min(std::min(columns.FirstBelow(run_start + 1, 1), width),
+                                    run_start + MAXIMUM_SIZE_WIDTH);
+        h_max = columns.ArgMax(run_start, run_end);
+
+        // Set left
+        k = columns.LastBelow(last, h_max + 1, 10);
+        coord.set_left((k >= 0 ? k : last) - 1);
 
-      // Set right
-      for (k = h_max; k < image->width(); k++) {
-        if (vec_sum_black[k] < 10) {
-          k++;
+        // Set right
+        k = columns.FirstBelow(h_max, 10);
+        coord.set_right(k < (int) width ? k + 1 : width);
+
+        if (coord.width() >= MINIMUM_WIDTH)
           break;
-        }
-      }
-      coord.set_right(k);
-      if (coord.width() < MINIMUM_WIDTH) {
+
         last = h_max + 1;
-        goto START;
       }
 
-
       // Check join
       if (coord.width() > MAXIMUM_SIZE_WIDTH) {
-        unsigned min_pos = 0;
-        unsigned min_val = image->height();
-        for (k = coord.left() + 30; k < coord.left() + MAXIMUM_SIZE_WIDTH; k++) {
-          if (vec_sum_black[k] < min_val) {
-            min_val = vec_sum_black[k];
-            min_pos = k;
-          }
-        }
-        coord.set_right(min_pos);
+        unsigned min_pos = columns.ArgMin(coord.left() + 30, coord.left() + MAXIMUM_SIZE_WIDTH);
+        coord.set_right(columns.value(min_pos) < (int) image->height() ? min_pos : 0);
       }
 
       //SearchHeight(image, coord);
-      unsigned sum;
       unsigned init = image->height() * LIMIT_SEARCH_INIT;
       unsigned fin = image->height() * LIMIT_SEARCH_FIN;
 
       // Accum horizontal BLACK and save to vector
       std::vector<int> vec(image->height());
-      for (unsigned y = 0; y < image->height(); y++) {
-        sum = 0;
-        for (unsigned x = coord.left(); x < coord.right(); x++) {
-          sum += !image->pixel(y * image->width() + x);
+      if (coord.left() < coord.right()) {
+        for (unsigned y = 0; y < image->height(); y++) {
+          auto line = row_black.begin() + y * (width + 1);
+          vec[y] = line[coord.right()] - line[coord.left()];
         }
-        vec[y] = sum;
       }
 
       // Find max value position of vector
@@ -297,9 +436,11 @@ namespace fpcard_slicer {
       return coord;
     }
 
-    std::vector<image::Clip> Slicer::SearchFingerprints(std::shared_ptr<image::Image> &image) {
+    std::vector<image::Clip> Slicer::SearchFingerprints(std::shared_ptr<image::Image> &image, unsigned count) {
       std::vector<image::Clip> coord_list;
       std::vector<int> vec_sum_black(image->width());
+      // Black pixels of each row before every column, (width + 1) per row
+      std::vector<unsigned> row_black((image->width() + 1) * image->height());
 
       for (auto &value:vec_sum_black) value = 0;
 
@@ -309,21 +450,176 @@ namespace fpcard_slicer {
         ++index;
       }
 
+      for (unsigned y = 0; y < image->height(); ++y) {
+        auto line = row_black.begin() + y * (image->width() + 1);
+        for (unsigned x = 0; x < image->width(); ++x)
+          line[x + 1] = line[x] + !image->pixel(x, y);
+      }
 
-      std::vector<int> vec_sum_black_max(vec_sum_black.begin(), vec_sum_black.end());
+      RangeIndex columns(vec_sum_black);
 
-      unsigned last = 0;
-      for (unsigned k = 0; k < (unsigned) _fp_number / 2; k++) {
-        auto coord = SearchFingerprint(image, last, vec_sum_black, vec_sum_black_max);
+      unsigned last = 0, start = 0;
+      for (unsigned k = 0; k < count; k++) {
+        auto coord = SearchFingerprint(image, last, start, columns, row_black);
 
-        for (unsigned i = 0; i <= coord.right(); i++) {
-          vec_sum_black_max[i] = 0;
-        }
+        start = std::max(start, coord.right() + 1);
         coord_list.push_back(coord);
         last = coord.right();
       }
 
       return coord_list;
     }
+
+    std::vector<image::Clip> Slicer::SearchLayout(std::shared_ptr<image::Image> &card,
+                                                  std::vector<std::shared_ptr<image::Image>> &regions) {
+      std::vector<image::Clip> result;
+
+      for (auto &box:_layout.boxes) {
+        auto region = box.Resolve(card->size(), _layout.margin);
+        metrics::StageScope stage(memstats::Filters);
+        auto image = card->Cut(region);
+
+        ApplyFilters(image);
+        stage.Switch(memstats::Search);
+        auto clip = SearchFingerprints(image, 1).front();
+
+        // The search edges may fall one pixel before the region
+        if ((int) clip.left() < 0)
+          clip.set_left(0);
+        if ((int) clip.top() < 0)
+          clip.set_top(0);
+
+        // Nothing found or the search left the region, the expected box is taken as it is
+        if (clip.left() >= clip.right() || clip.right() > image->width() || clip.width() < MINIMUM_WIDTH ||
+            clip.top() >= clip.bottom() || clip.bottom() > image->height() || clip.height() < MINIMUM_HEIGHT) {
+          clip = box.Resolve(card->size(), 0);
+        }
+        else {
+          clip.Expand(region.left(), region.top());
+        }
+
+        result.push_back(clip);
+        regions.push_back(image);
+      }
+
+      return result;
+    }
+
+    std::vector<image::Clip> Slicer::SearchComponents(std::shared_ptr<image::Image> &ink) {
+      std::vector<Component> blobs;
+
+      // Printed text and stains are too small or too sparse
+      for (auto &component : LabelComponents(ink, MAXIMUM_SIZE_WIDTH)) {
+        if (component.box.width() >= MINIMUM_WIDTH && component.box.height() >= MINIMUM_HEIGHT &&
+            component.density() >= MINIMUM_DENSITY)
+          blobs.push_back(component);
+      }
+
+      return (_mode == Sector) ? PlaceLayout(ink, blobs) : PlaceRows(ink, blobs);
+    }
+
+    std::vector<image::Clip> Slicer::PlaceRows(std::shared_ptr<image::Image> &ink, std::vector<Component> &blobs) {
+      const unsigned per_row = _fp_number / 2;
+      std::vector<image::Clip> result(per_row * 2);
+      std::vector<std::vector<Component>> rows;
+      unsigned bottom = 0;
+
+      // A blob starts a new row when its center is below every blob of the current one
+      std::sort(blobs.begin(), blobs.end(), [](Component a, Component b) {
+        return a.box.top() < b.box.top();
+      });
+      for (auto &blob : blobs) {
+        if (rows.empty() || Center(blob.box.top(), blob.box.bottom()) >= bottom) {
+          rows.emplace_back();
+          bottom = 0;
+        }
+        rows.back().push_back(blob);
+        bottom = std::max(bottom, blob.box.bottom());
+      }
+
+      auto row_ink = [](const std::vector<Component> &row) {
+        unsigned sum = 0;
+        for (auto &blob : row)
+          sum += blob.pixels;
+        return sum;
+      };
+      while (rows.size() > 2) {
+        rows.erase(std::min_element(rows.begin(), rows.end(),
+                                    [&](const std::vector<Component> &a, const std::vector<Component> &b) {
+                                      return row_ink(a) < row_ink(b);
+                                    }));
+      }
+
+      for (unsigned index = 0; index < rows.size(); ++index) {
+        auto &row = rows[index];
+
+        std::sort(row.begin(), row.end(), [](const Component &a, const Component &b) {
+          return a.pixels > b.pixels;
+        });
+        if (row.size() > per_row)
+          row.resize(per_row);
+
+        while (row.size() < per_row) {
+          auto widest = std::max_element(row.begin(), row.end(), [](Component a, Component b) {
+            return a.box.width() < b.box.width();
+          });
+          if (widest == row.end() || widest->box.width() <= MAXIMUM_SIZE_WIDTH)
+            break;
+          Split(ink, row, widest - row.begin());
+        }
+
+        std::sort(row.begin(), row.end(), [](Component a, Component b) {
+          return a.box.left() < b.box.left();
+        });
+
+        // A row found alone is the top or the bottom one by its place in the card
+        unsigned first = index * per_row;
+        if (rows.size() == 1 && Center(row.front().box.top(), row.front().box.bottom()) >= ink->height() / 2)
+          first = per_row;
+
+        // A missing finger leaves its column of the card empty
+        unsigned slot = 0;
+        for (unsigned k = 0; k < row.size(); ++k) {
+          unsigned column = Center(row[k].box.left(), row[k].box.right()) * per_row / ink->width();
+          slot = std::min(std::max(slot, column), per_row - (unsigned) (row.size() - k));
+          result[first + slot++] = row[k].box;
+        }
+      }
+
+      return result;
+    }
+
+    std::vector<image::Clip> Slicer::PlaceLayout(std::shared_ptr<image::Image> &ink, std::vector<Component> &blobs) {
+      std::vector<image::Clip> result;
+
+      for (auto &box : _layout.boxes) {
+        auto region = box.Resolve(ink->size(), _layout.margin);
+        auto expected = box.Resolve(ink->size(), 0);
+        unsigned x = Center(expected.left(), expected.right()), y = Center(expected.top(), expected.bottom());
+        int best = -1;
+
+        // Centered in the region, or joined to a neighbour over the center of the box
+        for (unsigned index = 0; index < blobs.size(); ++index) {
+          auto &blob = blobs[index].box;
+          unsigned blob_x = Center(blob.left(), blob.right()), blob_y = Center(blob.top(), blob.bottom());
+          bool centered = blob_x >= region.left() && blob_x < region.right() &&
+                          blob_y >= region.top() && blob_y < region.bottom();
+          bool over = x >= blob.left() && x < blob.right() && y >= blob.top() && y < blob.bottom();
+          if ((centered || over) && (best < 0 || blobs[index].pixels > blobs[best].pixels))
+            best = index;
+        }
+
+        if (best < 0) {
+          result.push_back(expected);
+          continue;
+        }
+
+        auto &blob = blobs[best].box;
+        result.push_back(image::Clip(std::max(blob.left(), region.left()), std::min(blob.right(), region.right()),
+                                     std::max(blob.top(), region.top()), std::min(blob.bottom(), region.bottom())));
+      }
+
+      return result;
+    }
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,169 @@
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include "image.h"
+#include "source_stream.h"
+
+namespace fpcard_slicer {
+  namespace application {
+    static std::string StripExtension(const std::string& path) {
+      auto dot = path.rfind('.');
+      auto slash = path.rfind('/');
+
+      if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path;
+
+      return path.substr(0, dot);
+    }
+
+    static const char *const IMAGE_EXTENSIONS[] = {".jpg", ".jpeg", ".png", ".JPG", ".JPEG", ".PNG"};
+
+    // relative without extension, unless another image with the same stem is beside path. Both are
+    // then named with their extension, the same whatever order they are found in.
+    static std::string OutputName(const std::string& path, const std::string& relative) {
+      std::string stem = StripExtension(path), extension = path.substr(stem.size());
+      struct stat info;
+
+      for (auto other : IMAGE_EXTENSIONS)
+        if (extension != other && stat((stem + other).c_str(), &info) == 0)
+          return relative;
+
+      return StripExtension(relative);
+    }
+
+    // Path of a list entry without ./ components and without the leading / of an absolute path.
+    // Empty for a path with .., it would leave the destination.
+    static std::string ListPath(const std::string& path) {
+      std::istringstream parts(path);
+      std::string part, name;
+
+      while (std::getline(parts, part, '/')) {
+        if (part == "..")
+          return "";
+        if (!part.empty() && part != ".")
+          name += (name.empty() ? "" : "/") + part;
+      }
+
+      return name;
+    }
+
+    SourceStream::SourceStream(const std::string &source, bool recursive, const std::string &list):
+      _recursive(recursive) {
+      struct stat info;
+
+      if (!source.empty() && stat(source.c_str(), &info) == 0) {
+        if (S_ISDIR(info.st_mode))
+          Open(source, "");
+        else
+          _file = source;
+      }
+
+      if (list == "-") {
+        _list = &std::cin;
+      } else if (!list.empty()) {
+        _list_file.open(list);
+        _list = &_list_file;
+      }
+    }
+
+    bool SourceStream::Next(Source &source) {
+      if (!_file.empty()) {
+        auto slash = _file.rfind('/');
+        source.path = _file;
+        source.name = OutputName(_file, slash == std::string::npos ? _file : _file.substr(slash + 1));
+        _file.clear();
+        return true;
+      }
+
+      while (!_directories.empty()) {
+        // Copy, Open may reallocate the stack
+        Directory directory = _directories.back();
+        struct dirent *entry = readdir(directory.handle.get());
+
+        if (entry == nullptr) {
+          _directories.pop_back();
+          continue;
+        }
+
+        std::string name(entry->d_name);
+        if (name == "." || name == "..")
+          continue;
+
+        std::string path = directory.path + "/" + name;
+        std::string relative = directory.relative.empty() ? name : directory.relative + "/" + name;
+        bool is_dir = entry->d_type == DT_DIR;
+        bool is_file = entry->d_type == DT_REG;
+
+        // Symbolic links to files are followed, to directories are not to avoid cycles
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+          struct stat info;
+          if (lstat(path.c_str(), &info) != 0)
+            continue;
+          bool link = S_ISLNK(info.st_mode);
+          if (link && stat(path.c_str(), &info) != 0)
+            continue;
+          is_dir = S_ISDIR(info.st_mode) && !link;
+          is_file = S_ISREG(info.st_mode);
+        }
+
+        if (is_dir && _recursive) {
+          Open(path, relative);
+        } else if (is_file && IsImageFile(name)) {
+          source.path = path;
+          source.name = OutputName(path, relative);
+          return true;
+        }
+      }
+
+      std::string line;
+      while (_list && std::getline(*_list, line)) {
+        if (!line.empty() && line.back() == '\r')
+          line.pop_back();
+        if (line.empty())
+          continue;
+        if (!IsImageFile(line)) {
+          std::cerr << line << " is not a png or jpg image, skipped." << std::endl;
+          continue;
+        }
+        std::string relative = ListPath(line);
+        if (relative.empty()) {
+          std::cerr << line << " goes out of its directory with .., skipped." << std::endl;
+          continue;
+        }
+
+        source.path = line;
+        source.name = OutputName(line, relative);
+        return true;
+      }
+
+      return false;
+    }
+
+    void SourceStream::Open(const std::string &path, const std::string &relative) {
+      std::shared_ptr<DIR> handle(opendir(path.c_str()), [](DIR* dir){ dir && closedir(dir); });
+
+      if (!handle) {
+        std::cerr << path << " could not be read." << std::endl;
+        return;
+      }
+
+      _directories.push_back({handle, path, relative});
+    }
+
+    unsigned ShardOf(const Source &source, unsigned count) {
+      // 64 bit FNV-1a, as the content hash of the manifest, std::hash may change between builds
+      unsigned long long hash = 14695981039346656037ULL;
+      for (unsigned char c : source.name) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+      }
+
+      return (unsigned) (hash % count) + 1;
+    }
+
+    bool IsImageFile(const std::string &name) {
+      auto format = image::Image::extension(name);
+      return format == image::Format::JPEG || format == image::Format::PNG;
+    }
+  }
+}
@@ -0,0 +1,129 @@
+#include "thread_pool.h"
+
+namespace fpcard_slicer {
+  namespace parallel {
+    ThreadPool::ThreadPool(unsigned threads) {
+      if (threads == 0)
+        threads = 1;
+
+      _ranges.reset(new Range[threads]);
+      for (unsigned participant = 1; participant < threads; ++participant)
+        _workers.emplace_back(&ThreadPool::Loop, this, participant);
+    }
+
+    ThreadPool::~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+      }
+      _start.notify_all();
+
+      for (auto &worker : _workers)
+        worker.join();
+    }
+
+    void ThreadPool::Run(unsigned count, const Task &task) {
+      if (_workers.empty() || count < 2) {
+        for (unsigned index = 0; index < count; ++index)
+          task(index);
+        return;
+      }
+
+      std::lock_guard<std::mutex> run_guard(_run_lock);
+      unsigned threads = size();
+      for (unsigned participant = 0; participant < threads; ++participant) {
+        std::lock_guard<std::mutex> guard(_ranges[participant].lock);
+        _ranges[participant].begin = count * participant / threads;
+        _ranges[participant].end = count * (participant + 1) / threads;
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _task = &task;
+        _error = nullptr;
+        _running = (unsigned) _workers.size();
+        ++_generation;
+      }
+      _start.notify_all();
+
+      Work(0);
+
+      std::unique_lock<std::mutex> lock(_lock);
+      _done.wait(lock, [this] { return _running == 0; });
+      _task = nullptr;
+
+      if (_error)
+        std::rethrow_exception(_error);
+    }
+
+    void ThreadPool::Loop(unsigned participant) {
+      unsigned long generation = 0;
+
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(_lock);
+          _start.wait(lock, [&] { return _stop || _generation != generation; });
+          if (_stop)
+            return;
+          generation = _generation;
+        }
+
+        Work(participant);
+
+        std::lock_guard<std::mutex> guard(_lock);
+        if (--_running == 0)
+          _done.notify_all();
+      }
+    }
+
+    void ThreadPool::Work(unsigned participant) {
+      unsigned index;
+
+      while (Next(participant, index)) {
+        try {
+          (*_task)(index);
+        } catch (...) {
+          std::lock_guard<std::mutex> guard(_lock);
+          if (!_error)
+            _error = std::current_exception();
+        }
+      }
+    }
+
+    bool ThreadPool::Next(unsigned participant, unsigned &index) {
+      {
+        Range &own = _ranges[participant];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (own.begin < own.end) {
+          index = own.begin++;
+          return true;
+        }
+      }
+
+      // Steal the upper half of the first thread with work left
+      unsigned threads = size();
+      for (unsigned i = 1; i < threads; ++i) {
+        unsigned begin, end;
+        {
+          Range &victim = _ranges[(participant + i) % threads];
+          std::lock_guard<std::mutex> guard(victim.lock);
+          if (victim.begin >= victim.end)
+            continue;
+
+          begin = victim.begin + (victim.end - victim.begin) / 2;
+          end = victim.end;
+          victim.end = begin;
+        }
+
+        Range &own = _ranges[participant];
+        std::lock_guard<std::mutex> guard(own.lock);
+        own.begin = begin + 1;
+        own.end = end;
+        index = begin;
+        return true;
+      }
+
+      return false;
+    }
+  }
+}
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <vector>
+#include "triage.h"
+
+namespace fpcard_slicer {
+  namespace slicer {
+    namespace {
+      TriageResult Result(Verdict verdict, const std::string &reason) {
+        TriageResult result;
+        result.verdict = verdict;
+        result.reason = reason;
+        return result;
+      }
+    }
+
+    TriageResult Triage(std::shared_ptr<image::Image> &thumbnail) {
+      return Triage(thumbnail, thumbnail->histogram());
+    }
+
+    TriageResult Triage(std::shared_ptr<image::Image> &thumbnail, const image::Histogram &histogram) {
+      const unsigned width = thumbnail->width(), height = thumbnail->height();
+      const unsigned total = width * height;
+
+      if (total == 0)
+        return Result(Rejected, "empty image");
+
+      // Paper is the 90th percentile of brightness, ink the 2nd one
+
+      auto percentile = [&](float fraction) {
+        unsigned accum = 0;
+        for (unsigned value = 0; value < histogram.size(); ++value) {
+          accum += histogram[value];
+          if (accum >= fraction * total)
+            return (int) value;
+        }
+        return 255;
+      };
+
+      int paper = percentile(0.9), ink = percentile(0.02);
+      if (paper - ink < MINIMUM_CONTRAST)
+        return Result(Rejected, "no contrast, blank or dark page");
+
+      // Ink per row and per half
+      int umbral = (paper + ink) / 2;
+      std::vector<unsigned> row_ink(height, 0);
+      unsigned top_ink = 0, all_ink = 0;
+      for (unsigned y = 0; y < height; ++y) {
+        for (unsigned x = 0; x < width; ++x)
+          row_ink[y] += thumbnail->pixel(x, y) < umbral;
+        all_ink += row_ink[y];
+        if (y < height / 2)
+          top_ink += row_ink[y];
+      }
+
+      float coverage = (float) all_ink / total;
+      if (coverage < MINIMUM_COVERAGE)
+        return Result(Rejected, "blank page, " + std::to_string((int) (coverage * 100)) + "% ink");
+      if (coverage > MAXIMUM_COVERAGE)
+        return Result(Rejected, "not a card, " + std::to_string((int) (coverage * 100)) + "% ink");
+
+      if (height > width * MAXIMUM_ASPECT)
+        return Result(Rejected, "portrait page, the card may be rotated");
+
+      // Fingers make tall runs of inked rows, text and forms make thin ones
+      unsigned run = 0, longest = 0;
+      for (auto value : row_ink) {
+        run = (value * height > all_ink / 2) ? run + 1 : 0;
+        longest = std::max(longest, run);
+      }
+      if (longest < MINIMUM_BAND * height)
+        return Result(Rejected, "no finger rows");
+
+      if (std::min(top_ink, all_ink - top_ink) < MINIMUM_HALF_INK * all_ink)
+        return Result(Flagged, std::string(top_ink * 2 < all_ink ? "top" : "bottom") + " half almost empty");
+
+      return TriageResult();
+    }
+  }
+}
@@ -2,23 +2,113 @@
 
 #include <jpeglib.h>
 
+#include <csetjmp>
+#include <cstdio>
 #include <fstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
 namespace jpeg {
-  void load_file(const std::string& filename, std::vector<unsigned char>&out, unsigned& w, unsigned& h) {
+  // The default error_exit of libjpeg ends the process. This one jumps back to the function that
+  // called libjpeg, which throws from its own frame: exceptions never cross the C code.
+  struct error_manager {
+    ::jpeg_error_mgr pub;
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+  };
+
+  static void error_exit(::j_common_ptr info) {
+    auto error = (error_manager *) info->err;
+    (*info->err->format_message)(info, error->message);
+    std::longjmp(error->jump, 1);
+  }
+
+  static ::jpeg_error_mgr *throwing_error(error_manager &error) {
+    ::jpeg_std_error(&error.pub);
+    error.pub.error_exit = error_exit;
+    error.message[0] = '\0';
+    return &error.pub;
+  }
+
+  static unsigned density_ppi(const ::jpeg_decompress_struct *info) {
+    if (!info->saw_JFIF_marker)
+      return 0;
+
+    switch (info->density_unit) {
+      case 1: // dots per inch
+        return info->X_density;
+      case 2: // dots per cm
+        return (unsigned) (info->X_density * 2.54 + 0.5);
+      default:
+        return 0;
+    }
+  }
+
+  void read_info(const std::string& filename, unsigned& w, unsigned& h, unsigned& ppi) {
+    // Zeroed, destroying it before jpeg_create_decompress does nothing
+    auto dt = []( ::jpeg_decompress_struct *ds )
+    {
+      ::jpeg_destroy_decompress( ds );
+      delete ds;
+    };
+    std::unique_ptr<::jpeg_decompress_struct, decltype(dt)> decompress_info(
+      new ::jpeg_decompress_struct(),
+      dt
+    );
+
+    error_manager error;
+
+    auto fdt = []( FILE* fp )
+    {
+      fclose( fp );
+    };
+    std::unique_ptr<FILE, decltype(fdt)> infile(
+      fopen( filename.c_str(), "rb" ),
+      fdt
+    );
+    if ( infile.get() == NULL )
+    {
+      throw std::runtime_error( "Could not open " + filename );
+    }
+
+    decompress_info->err = throwing_error( error );
+    if ( setjmp( error.jump ) )
+    {
+      throw std::runtime_error( filename + ": " + error.message );
+    }
+
+    ::jpeg_create_decompress( decompress_info.get() );
+
+    ::jpeg_stdio_src( decompress_info.get(), infile.get() );
+
+    int rc = ::jpeg_read_header( decompress_info.get(), TRUE );
+    if (rc != 1)
+    {
+      throw std::runtime_error(
+        "File does not seem to be a normal JPEG"
+      );
+    }
+
+    w = decompress_info->image_width;
+    h = decompress_info->image_height;
+    ppi = density_ppi( decompress_info.get() );
+  }
+
+  void load_file(const std::string& filename, std::vector<unsigned char>&out, unsigned& w, unsigned& h, unsigned& ppi,
+                 unsigned scale_denom) {
+    // Zeroed, destroying it before jpeg_create_decompress does nothing
     auto dt = []( ::jpeg_decompress_struct *ds )
     {
       ::jpeg_destroy_decompress( ds );
+      delete ds;
     };
     std::unique_ptr<::jpeg_decompress_struct, decltype(dt)> decompress_info(
-      new ::jpeg_decompress_struct,
+      new ::jpeg_decompress_struct(),
       dt
     );
 
-    auto error = std::make_shared<::jpeg_error_mgr>();
+    error_manager error;
 
     auto fdt = []( FILE* fp )
     {
@@ -33,7 +123,11 @@ namespace jpeg {
       throw std::runtime_error( "Could not open " + filename );
     }
 
-    decompress_info->err = ::jpeg_std_error( error.get() );
+    decompress_info->err = throwing_error( error );
+    if ( setjmp( error.jump ) )
+    {
+      throw std::runtime_error( filename + ": " + error.message );
+    }
 
     ::jpeg_create_decompress( decompress_info.get() );
 
@@ -46,10 +140,13 @@ namespace jpeg {
         "File does not seem to be a normal JPEG"
       );
     }
+    decompress_info->scale_num = 1;
+    decompress_info->scale_denom = scale_denom;
     ::jpeg_start_decompress( decompress_info.get() );
 
     w = decompress_info->output_width;
     h = decompress_info->output_height;
+    ppi = density_ppi( decompress_info.get() );
     auto pixelsize = decompress_info->output_components;
     auto colour_space = decompress_info->out_color_space;
 
@@ -58,13 +155,12 @@ namespace jpeg {
 
     size_t row_stride = w * pixelsize;
 
-    out.clear();
+    // Rows are decoded in place, the image is never copied to grow
+    out.resize(row_stride * h);
     while ( decompress_info->output_scanline < h )
     {
-      std::vector<uint8_t> vec(row_stride);
-      uint8_t* p = vec.data();
+      uint8_t* p = out.data() + row_stride * decompress_info->output_scanline;
       ::jpeg_read_scanlines( decompress_info.get(), &p, 1 );
-      out.insert(out.end(), &p[0], &p[row_stride]);
     }
     ::jpeg_finish_decompress( decompress_info.get() );
   }
@@ -73,8 +169,15 @@ namespace jpeg {
     if (quality < 0) quality = 0;
     if (quality > 100) quality = 100;
 
-    FILE* outfile = fopen( filename.c_str(), "wb" );
-    if ( outfile == NULL )
+    auto fdt = []( FILE* fp )
+    {
+      fclose( fp );
+    };
+    std::unique_ptr<FILE, decltype(fdt)> outfile(
+      fopen( filename.c_str(), "wb" ),
+      fdt
+    );
+    if ( outfile.get() == NULL )
     {
       throw std::runtime_error(
         "Could not open " + filename + " for writing"
@@ -84,26 +187,36 @@ namespace jpeg {
     auto dt = []( ::jpeg_compress_struct *cs )
     {
       ::jpeg_destroy_compress( cs );
+      delete cs;
     };
     std::unique_ptr<::jpeg_compress_struct, decltype(dt)> compress_info(
-      new ::jpeg_compress_struct,
+      new ::jpeg_compress_struct(),
       dt );
+    error_manager error;
+    compress_info->err = throwing_error( error );
+    // A truncated file is not left behind
+    if ( setjmp( error.jump ) )
+    {
+      compress_info.reset();
+      outfile.reset();
+      std::remove( filename.c_str() );
+      throw std::runtime_error( filename + ": " + error.message );
+    }
+
     ::jpeg_create_compress( compress_info.get() );
-    ::jpeg_stdio_dest( compress_info.get(), outfile);
+    ::jpeg_stdio_dest( compress_info.get(), outfile.get() );
     compress_info->image_width = w;
     compress_info->image_height = h;
     compress_info->input_components = 1;
     compress_info->in_color_space = static_cast<::J_COLOR_SPACE>( JCS_GRAYSCALE );
-    auto error = std::make_shared<::jpeg_error_mgr>();
-    compress_info->err = ::jpeg_std_error( error.get() );
     ::jpeg_set_defaults( compress_info.get() );
     ::jpeg_set_quality( compress_info.get(), quality, TRUE );
     ::jpeg_start_compress( compress_info.get(), TRUE);
 
-    for(int line =0; line <h; ++line) {
-      std::vector<unsigned char> vec_line(in.begin()+(w*line), in.begin()+(w*line) + w);
+    // Rows are given in place, nothing with a destructor may be alive when libjpeg jumps back
+    for(unsigned line = 0; line < h; ++line) {
       ::JSAMPROW rowPtr[1];
-      rowPtr[0] = const_cast<::JSAMPROW>( vec_line.data() );
+      rowPtr[0] = in.data() + (size_t) w * line;
       ::jpeg_write_scanlines(
         compress_info.get(),
         rowPtr,
@@ -111,6 +224,12 @@ namespace jpeg {
       );
     }
     ::jpeg_finish_compress( compress_info.get() );
-    fclose( outfile );
+    compress_info.reset();
+
+    if ( fclose( outfile.release() ) != 0 )
+    {
+      std::remove( filename.c_str() );
+      throw std::runtime_error( "Could not write " + filename );
+    }
   }
 }
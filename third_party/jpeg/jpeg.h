@@ -9,7 +9,11 @@
 struct jpeg_error_mgr;
 
 namespace jpeg{
-  void load_file(const std::string&, std::vector<unsigned char>&, unsigned&, unsigned&);
+  // Width, height and resolution in pixels per inch (0 if the file has none)
+  void read_info(const std::string&, unsigned&, unsigned&, unsigned&);
+  // scale_denom 2, 4 or 8 decodes a reduced image straight from the DCT coefficients
+  void load_file(const std::string&, std::vector<unsigned char>&, unsigned&, unsigned&, unsigned&,
+                 unsigned scale_denom = 1);
   void save_file(const std::string& filename, std::vector<unsigned char>in, unsigned w, unsigned h, int quality );
 }
 
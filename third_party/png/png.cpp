@@ -0,0 +1,196 @@
+#include "png.h"
+
+#include <png.h>
+
+#include <csetjmp>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace png {
+  namespace {
+    struct ReadGuard {
+      FILE* file = nullptr;
+      png_structp png_ptr = nullptr;
+      png_infop info_ptr = nullptr;
+      ~ReadGuard() {
+        if (png_ptr)
+          png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : nullptr, nullptr);
+        if (file)
+          fclose(file);
+      }
+    };
+
+    // The file is removed unless the image was written whole
+    struct WriteGuard {
+      FILE* file = nullptr;
+      png_structp png_ptr = nullptr;
+      png_infop info_ptr = nullptr;
+      std::string filename;
+      bool written = false;
+      ~WriteGuard() {
+        if (png_ptr)
+          png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : nullptr);
+        if (file)
+          fclose(file);
+        if (file && !written)
+          remove(filename.c_str());
+      }
+    };
+
+    void open(ReadGuard& guard, const std::string& filename) {
+      guard.file = fopen(filename.c_str(), "rb");
+      if (guard.file == NULL)
+        throw std::runtime_error("Could not open " + filename);
+
+      guard.png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+      if (guard.png_ptr)
+        guard.info_ptr = png_create_info_struct(guard.png_ptr);
+      if (!guard.png_ptr || !guard.info_ptr)
+        throw std::runtime_error("Could not allocate png decoder");
+    }
+
+    unsigned density_ppi(png_structp png_ptr, png_infop info_ptr) {
+      png_uint_32 res_x, res_y;
+      int unit;
+
+      if (!png_get_pHYs(png_ptr, info_ptr, &res_x, &res_y, &unit) || unit != PNG_RESOLUTION_METER)
+        return 0;
+
+      return (unsigned) (res_x * 0.0254 + 0.5);
+    }
+  }
+
+  void read_info(const std::string& filename, unsigned& w, unsigned& h, unsigned& ppi) {
+    ReadGuard guard;
+    open(guard, filename);
+
+    if (setjmp(png_jmpbuf(guard.png_ptr)))
+      throw std::invalid_argument("Decode error: " + filename);
+
+    png_init_io(guard.png_ptr, guard.file);
+    png_read_info(guard.png_ptr, guard.info_ptr);
+
+    w = png_get_image_width(guard.png_ptr, guard.info_ptr);
+    h = png_get_image_height(guard.png_ptr, guard.info_ptr);
+    ppi = density_ppi(guard.png_ptr, guard.info_ptr);
+  }
+
+  void read_rows(const std::string& filename, HeaderCallback on_header, RowCallback on_row) {
+    ReadGuard guard;
+    std::vector<unsigned char> buffer;
+    std::vector<png_bytep> rows;
+
+    open(guard, filename);
+
+    // libpng reports errors with longjmp, only the guard and the buffers live across it
+    if (setjmp(png_jmpbuf(guard.png_ptr)))
+      throw std::invalid_argument("Decode error: " + filename);
+
+    png_init_io(guard.png_ptr, guard.file);
+    png_read_info(guard.png_ptr, guard.info_ptr);
+
+    png_uint_32 w = png_get_image_width(guard.png_ptr, guard.info_ptr);
+    png_uint_32 h = png_get_image_height(guard.png_ptr, guard.info_ptr);
+    int color_type = png_get_color_type(guard.png_ptr, guard.info_ptr);
+    int bit_depth = png_get_bit_depth(guard.png_ptr, guard.info_ptr);
+
+    // 8 bit gray for every color type, the streamed and the full decode both come through here.
+    // Color is weighted by luminance (libpng defaults), lodepng took the red channel alone, so a
+    // color scan is not decoded to the same pixels as before libpng. Gray scans are.
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_palette_to_rgb(guard.png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+      png_set_expand_gray_1_2_4_to_8(guard.png_ptr);
+    if (bit_depth == 16)
+      png_set_strip_16(guard.png_ptr);
+    if (color_type & PNG_COLOR_MASK_ALPHA)
+      png_set_strip_alpha(guard.png_ptr);
+    if (color_type & PNG_COLOR_MASK_COLOR || color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_rgb_to_gray_fixed(guard.png_ptr, 1, -1, -1);
+
+    int passes = png_set_interlace_handling(guard.png_ptr);
+    png_read_update_info(guard.png_ptr, guard.info_ptr);
+
+    if (png_get_rowbytes(guard.png_ptr, guard.info_ptr) != w)
+      throw std::invalid_argument("Decode error: unsupported color type in " + filename);
+
+    on_header(w, h, density_ppi(guard.png_ptr, guard.info_ptr));
+
+    if (passes == 1) {
+      buffer.resize(w);
+      for (png_uint_32 y = 0; y < h; ++y) {
+        png_read_row(guard.png_ptr, buffer.data(), nullptr);
+        on_row(buffer.data(), y);
+      }
+    } else {
+      // Interlaced rows are only final after the last pass
+      buffer.resize((size_t) w * h);
+      rows.resize(h);
+      for (png_uint_32 y = 0; y < h; ++y)
+        rows[y] = buffer.data() + (size_t) y * w;
+      png_read_image(guard.png_ptr, rows.data());
+      for (png_uint_32 y = 0; y < h; ++y)
+        on_row(rows[y], y);
+    }
+
+    png_read_end(guard.png_ptr, nullptr);
+  }
+
+  void load_file(const std::string& filename, std::vector<unsigned char>& out, unsigned& w, unsigned& h,
+                 unsigned& ppi) {
+    out.clear();
+    read_rows(filename,
+              [&](unsigned width, unsigned height, unsigned resolution) {
+                w = width;
+                h = height;
+                ppi = resolution;
+                out.reserve((size_t) w * h);
+              },
+              [&](const unsigned char* row, unsigned) {
+                out.insert(out.end(), row, row + w);
+              });
+  }
+
+  void save_file(const std::string& filename, const std::vector<unsigned char>& in, unsigned w, unsigned h,
+                 int level, int filter, unsigned ppi) {
+    static const int filters[] = {PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG,
+                                  PNG_FILTER_PAETH, PNG_ALL_FILTERS};
+    WriteGuard guard;
+
+    guard.filename = filename;
+    guard.file = fopen(filename.c_str(), "wb");
+    if (guard.file == NULL)
+      throw std::runtime_error("Could not open " + filename + " for writing");
+
+    guard.png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (guard.png_ptr)
+      guard.info_ptr = png_create_info_struct(guard.png_ptr);
+    if (!guard.png_ptr || !guard.info_ptr)
+      throw std::runtime_error("Could not allocate png encoder");
+
+    if (setjmp(png_jmpbuf(guard.png_ptr)))
+      throw std::invalid_argument("Encode error: " + filename);
+
+    png_init_io(guard.png_ptr, guard.file);
+    png_set_IHDR(guard.png_ptr, guard.info_ptr, w, h, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (ppi)
+      png_set_pHYs(guard.png_ptr, guard.info_ptr, (png_uint_32) (ppi / 0.0254 + 0.5),
+                   (png_uint_32) (ppi / 0.0254 + 0.5), PNG_RESOLUTION_METER);
+
+    png_set_compression_level(guard.png_ptr, level < 0 ? 0 : (level > 9 ? 9 : level));
+    png_set_filter(guard.png_ptr, 0, filters[(filter < 0 || filter > 5) ? 5 : filter]);
+
+    png_write_info(guard.png_ptr, guard.info_ptr);
+    for (unsigned y = 0; y < h; ++y)
+      png_write_row(guard.png_ptr, in.data() + (size_t) y * w);
+    png_write_end(guard.png_ptr, nullptr);
+
+    // The guard closes the file, check the buffered data reached it
+    if (fflush(guard.file) != 0)
+      throw std::runtime_error("Could not write " + filename);
+    guard.written = true;
+  }
+}
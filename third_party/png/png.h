@@ -0,0 +1,26 @@
+#ifndef FPCARD_SLICER_PNG_H
+#define FPCARD_SLICER_PNG_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace png {
+  // Width, height and resolution in pixels per inch (0 if the file has none)
+  typedef std::function<void(unsigned, unsigned, unsigned)> HeaderCallback;
+  typedef std::function<void(const unsigned char*, unsigned)> RowCallback;
+
+  // Decodes as 8 bit grayscale, color by luminance. on_header receives width and height, then on_row
+  // receives every row in order, so the caller decides what is kept in memory.
+  void read_rows(const std::string& filename, HeaderCallback on_header, RowCallback on_row);
+  void read_info(const std::string&, unsigned&, unsigned&, unsigned&);
+  void load_file(const std::string&, std::vector<unsigned char>&, unsigned&, unsigned&, unsigned&);
+  // 8 bit grayscale. level is the zlib level (0-9), filter the PNG row filter type
+  // (0 none, 1 sub, 2 up, 3 average, 4 paeth) or 5 to let libpng choose per row.
+  // ppi is written in the pHYs chunk when it is not 0. libpng refuses an empty image, the file is
+  // removed when the image could not be written whole.
+  void save_file(const std::string&, const std::vector<unsigned char>&, unsigned, unsigned, int level,
+                 int filter, unsigned ppi);
+}
+
+#endif //FPCARD_SLICER_PNG_H